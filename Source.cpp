@@ -8,6 +8,48 @@
 #include <list>
 #include <numeric> 
 #include <cmath>
+#include <limits>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <bit>
+#include <type_traits>
+#include <cstring>
+#include <span>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <charconv>
+#include <fstream>
+#include <filesystem>
+#include <cstdio>
+#include <tuple>
+#include <stdexcept>
+#include <utility>
+#include <random>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <coroutine>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 
 enum class OrderType {
 	GoodTillCancel, 
@@ -19,9 +61,70 @@ enum class Side {
 	Sell
 };
 
+enum class SelfTradePrevention {
+	None,
+	CancelNewest,
+	CancelOldest,
+	CancelBoth,
+	Decrement
+};
+
+enum class PostOnly {
+	None,
+	Reject,
+	Reprice
+};
+
+enum class TradingPhase {
+	Continuous,
+	Auction
+};
+
+enum class MapMode {
+	ReadOnly,
+	ReadWrite
+};
+
+enum class LevelAction : std::uint8_t {
+	New,
+	Change,
+	Delete
+};
+
+enum class OrderEventType : std::uint8_t {
+	Added,
+	Reduced,
+	Executed,
+	Deleted,
+	Replaced
+};
+
+enum class AckStatus : std::uint8_t {
+	Accepted,
+	Rejected
+};
+
+enum class CommandType : std::uint8_t {
+	Add,
+	Cancel,
+	Modify
+};
+
 using Price = std::int32_t; 
 using Quantity = std::uint32_t;
 using OrderId = std::uint64_t; 
+using OwnerId = std::uint32_t; 
+using SymbolId = std::uint32_t; 
+using SequenceNumber = std::uint64_t; 
+
+constexpr std::size_t CacheLineSize = 64; 
+
+struct Constants {
+	//--- Orders without an owner never trigger self-trade prevention 
+	static constexpr OwnerId NoOwner = 0; 
+	//--- Default bound on symbol ids per manager, the book table never grows past it 
+	static constexpr std::size_t MaxSymbols = std::size_t{ 1 } << 20; 
+};
 
 
 struct LevelInfo {
@@ -55,32 +158,48 @@ private:
 	Side		side_;
 	Quantity	initial_quantity_, remaining_quantity_; 
 	Price		price_;
+	OwnerId		owner_id_; 
+	std::uint64_t	arrival_{ 0 }; 
+	PostOnly	post_only_{ PostOnly::None }; 
+	Quantity	minimum_quantity_{ 0 }; 
 
 
 public:
-	Order(OrderType order_type, OrderId order_id, Side side, Price price, Quantity quantity);
+	Order(OrderType order_type, OrderId order_id, Side side, Price price, Quantity quantity, 
+		OwnerId owner_id = Constants::NoOwner);
 
 	//--- Wrappers 
 	OrderId		GetOrderId()	const { return order_id_; }
 	Side		GetSide()		const { return side_;  }
 	Price		GetPrice()		const { return price_;  }
 	OrderType	GetOrderType()	const { return order_type_;  }
+	OwnerId		GetOwnerId()	const { return owner_id_; }
+	std::uint64_t	GetArrival()	const { return arrival_; }
+	PostOnly	GetPostOnly()	const { return post_only_; }
+	Quantity	GetMinimumQuantity() const { return minimum_quantity_; }
 	Quantity	GetInitialQuantity() const { return initial_quantity_; }
 	Quantity	GetRemainingQuantity() const { return remaining_quantity_;  }
 	Quantity    GetFilledQuantity() const { return GetInitialQuantity() - GetRemainingQuantity(); }
 	bool IsFilled() const { return GetRemainingQuantity() == 0; }
 	void Fill(Quantity quantity); 
+	void Reduce(Quantity quantity); 
+	void SetArrival(std::uint64_t arrival) { arrival_ = arrival; }
+	void SetPostOnly(PostOnly post_only) { post_only_ = post_only; }
+	void SetMinimumQuantity(Quantity minimum_quantity) { minimum_quantity_ = minimum_quantity; }
+	void Reprice(Price price) { price_ = price; }
+	void Requote(Price price, Quantity quantity); 
 	
 };
 
 //--- ORDER CLASS 
-Order::Order(OrderType order_type, OrderId order_id, Side side, Price price, Quantity quantity) 
+Order::Order(OrderType order_type, OrderId order_id, Side side, Price price, Quantity quantity, OwnerId owner_id) 
 	: order_type_ { order_type }
 	, order_id_ { order_id }
 	, side_ { side }
 	, price_ { price }
 	, initial_quantity_ { quantity }
-	, remaining_quantity_ { quantity} {}
+	, remaining_quantity_ { quantity}
+	, owner_id_ { owner_id } {}
 
 void Order::Fill(Quantity quantity) {
 	if (quantity > GetRemainingQuantity()) {
@@ -90,6 +209,24 @@ void Order::Fill(Quantity quantity) {
 	remaining_quantity_ -= quantity; 
 }
 
+void Order::Reduce(Quantity quantity) {
+	//--- Removes open quantity without a fill, keeping the filled quantity intact 
+	if (quantity > GetRemainingQuantity()) {
+		throw std::logic_error(std::format("Order ({}) cannot be reduced for more than remaining quantity",
+			GetOrderId()));
+	}
+	initial_quantity_ -= quantity; 
+	remaining_quantity_ -= quantity; 
+}
+
+
+void Order::Requote(Price price, Quantity quantity) {
+	//--- A requoted order starts over with the new quantity, reusing the same slot 
+	price_ = price; 
+	initial_quantity_ = quantity; 
+	remaining_quantity_ = quantity; 
+}
+
 
 using OrderPointer = std::shared_ptr<Order>; 
 using OrderPointers = std::list<OrderPointer>; 
@@ -109,7 +246,7 @@ public:
 	Price GetPrice() const { return price_; }
 	Quantity GetQuantity() const { return quantity_; }
 
-	OrderPointer ToOrderPointer(OrderType type) const; 
+	OrderPointer ToOrderPointer(OrderType type, OwnerId owner_id = Constants::NoOwner, PostOnly post_only = PostOnly::None) const; 
 };
 
 OrderModify::OrderModify(OrderId order_id, Side side, Price price, Quantity quantity)
@@ -119,9 +256,11 @@ OrderModify::OrderModify(OrderId order_id, Side side, Price price, Quantity quan
 	, quantity_ { quantity } {}
 
 
-OrderPointer OrderModify::ToOrderPointer(OrderType type) const {
-	//--- Order Needs: OrderType, OrderId, Side, Price, Quantity
-	return std::make_shared<Order>(type, GetOrderId(), GetSide(), GetPrice(), GetQuantity()); 
+OrderPointer OrderModify::ToOrderPointer(OrderType type, OwnerId owner_id, PostOnly post_only) const {
+	//--- Order Needs: OrderType, OrderId, Side, Price, Quantity, OwnerId, plus the post-only flag it keeps across a modify 
+	auto order = std::make_shared<Order>(type, GetOrderId(), GetSide(), GetPrice(), GetQuantity(), owner_id); 
+	order->SetPostOnly(post_only); 
+	return order; 
 }
 
 
@@ -135,56 +274,932 @@ struct TradeInfo {
 class Trade {
 private:
 	TradeInfo bid_trade_, ask_trade_; 
+	SequenceNumber sequence_; 
 public: 
-	Trade(const TradeInfo& bid_trade, const TradeInfo& ask_trade); 
+	Trade(const TradeInfo& bid_trade, const TradeInfo& ask_trade, SequenceNumber sequence = 0); 
 	
 	const TradeInfo& GetBidTrade() const { return bid_trade_; }
 	const TradeInfo& GetAskTrade() const { return ask_trade_; }
+	SequenceNumber GetSequence() const { return sequence_; }
 };
 
-Trade::Trade(const TradeInfo& bid_trade, const TradeInfo& ask_trade) 
+Trade::Trade(const TradeInfo& bid_trade, const TradeInfo& ask_trade, SequenceNumber sequence) 
 	: bid_trade_{ bid_trade }
-	, ask_trade_{ ask_trade } {}
+	, ask_trade_{ ask_trade }
+	, sequence_{ sequence } {}
 
 
 using Trades = std::vector<Trade>;
 
+struct Quote {
+	OrderId order_id_; 
+	Side side_; 
+	Price price_; 
+	Quantity quantity_; 
+};
+
+using Quotes = std::vector<Quote>; 
+
+//--- Fixed-size command record, trivially copyable so it can be queued and routed by value 
+struct Command {
+	SequenceNumber sequence_; 
+	OrderId order_id_; 
+	SymbolId symbol_id_; 
+	Price price_; 
+	Quantity quantity_; 
+	OwnerId owner_id_; 
+	CommandType type_; 
+	OrderType order_type_; 
+	Side side_; 
+	//--- Maker flags, only read by Add 
+	PostOnly post_only_; 
+	Quantity minimum_quantity_; 
+};
+
+//--- Commands read from outside the process can hold any bytes, every enum field must name a declared value 
+inline bool IsWellFormed(const Command& command) {
+	auto Within = [](auto value, auto last) { return static_cast<std::uint64_t>(value) <= static_cast<std::uint64_t>(last); }; 
+	return Within(command.type_, CommandType::Modify) && Within(command.order_type_, OrderType::FillAndKill) 
+		&& Within(command.side_, Side::Sell) && Within(command.post_only_, PostOnly::Reprice); 
+}
+
+//--- Builds the order an Add command describes, maker flags included 
+inline OrderPointer MakeOrder(const Command& command) {
+	auto order = std::make_shared<Order>(command.order_type_, command.order_id_, command.side_, 
+		command.price_, command.quantity_, command.owner_id_); 
+	order->SetPostOnly(command.post_only_); 
+	order->SetMinimumQuantity(command.minimum_quantity_); 
+	return order; 
+}
+
+struct TopOfBook {
+	Price bid_price_; 
+	Quantity bid_quantity_; 
+	Price ask_price_; 
+	Quantity ask_quantity_; 
+	SequenceNumber event_sequence_; 
+};
+
+//--- Single-writer seqlock, readers on other cores retry instead of blocking the writer 
+template <typename T>
+class alignas(CacheLineSize) Seqlock {
+	static_assert(std::is_trivially_copyable_v<T>, "seqlock values are copied word by word"); 
+private:
+	static constexpr std::size_t Words = (sizeof(T) + sizeof(std::uint64_t) - 1) / sizeof(std::uint64_t); 
+	std::atomic<std::uint64_t> version_{ 0 }; 
+	std::atomic<std::uint64_t> words_[Words]{}; 
+
+public:
+	void Store(const T& value); 
+	T Load() const; 
+};
+
+//--- SEQLOCK 
+template <typename T>
+void Seqlock<T>::Store(const T& value) {
+	std::uint64_t words[Words]{}; 
+	std::memcpy(words, &value, sizeof(T)); 
+
+	const auto version = version_.load(std::memory_order_relaxed); 
+	version_.store(version + 1, std::memory_order_relaxed); 
+	std::atomic_thread_fence(std::memory_order_release); 
+	for (std::size_t i = 0; i < Words; ++i) words_[i].store(words[i], std::memory_order_relaxed); 
+	version_.store(version + 2, std::memory_order_release); 
+}
+
+template <typename T>
+T Seqlock<T>::Load() const {
+	std::uint64_t words[Words]; 
+	std::uint64_t before, after; 
+	do {
+		before = version_.load(std::memory_order_acquire); 
+		for (std::size_t i = 0; i < Words; ++i) words[i] = words_[i].load(std::memory_order_relaxed); 
+		std::atomic_thread_fence(std::memory_order_acquire); 
+		after = version_.load(std::memory_order_relaxed); 
+	} while (before != after || (before & 1)); 
+
+	T value; 
+	std::memcpy(&value, words, sizeof(T)); 
+	return value; 
+}
+
+//--- Shared so reader threads can keep one after the book that published into it is gone 
+using TopOfBookHandle = std::shared_ptr<const Seqlock<TopOfBook>>; 
+
+struct DepthSnapshot {
+	LevelInfos bids_, asks_; 
+	SequenceNumber event_sequence_{ 0 }; 
+};
+
+//--- Two preallocated snapshots behind an atomic pointer. The writer only fills the buffer readers 
+//--- are not on and skips a publish rather than wait for a slow reader to leave it 
+class DepthBuffer {
+private:
+	struct Buffer {
+		DepthSnapshot snapshot_; 
+		mutable std::atomic<std::uint32_t> readers_{ 0 }; 
+	};
+	std::size_t depth_; 
+	Buffer buffers_[2]; 
+	std::atomic<Buffer*> current_; 
+
+public:
+	explicit DepthBuffer(std::size_t depth); 
+
+	DepthSnapshot* BeginWrite(); 
+	void EndWrite(); 
+	template <typename Reader>
+	void Read(Reader&& reader) const; 
+
+	std::size_t GetDepth() const { return depth_; }
+};
+
+//--- DEPTH BUFFER 
+DepthBuffer::DepthBuffer(std::size_t depth)
+	: depth_ { depth } {
+	for (auto& buffer : buffers_) {
+		buffer.snapshot_.bids_.reserve(depth); 
+		buffer.snapshot_.asks_.reserve(depth); 
+	}
+	current_.store(&buffers_[0]); 
+}
+
+DepthSnapshot* DepthBuffer::BeginWrite() {
+	auto* back = current_.load() == &buffers_[0] ? &buffers_[1] : &buffers_[0]; 
+	if (back->readers_.load() != 0) return nullptr; 
+	return &back->snapshot_; 
+}
+
+void DepthBuffer::EndWrite() {
+	current_.store(current_.load() == &buffers_[0] ? &buffers_[1] : &buffers_[0]); 
+}
+
+template <typename Reader>
+void DepthBuffer::Read(Reader&& reader) const {
+	//--- Register on the current buffer, then confirm it is still current so the writer cannot be filling it 
+	const Buffer* buffer; 
+	while (true) {
+		buffer = current_.load(); 
+		buffer->readers_.fetch_add(1); 
+		if (buffer == current_.load()) break; 
+		buffer->readers_.fetch_sub(1); 
+	}
+	reader(buffer->snapshot_); 
+	buffer->readers_.fetch_sub(1, std::memory_order_release); 
+}
+
+//--- Bounded single-producer ring, each side caches the other's index to avoid cross-core reads 
+template <typename T>
+class SpscRing {
+	static_assert(std::is_trivially_copyable_v<T>, "ring records are copied by value"); 
+private:
+	std::unique_ptr<T[]> slots_; 
+	std::size_t mask_; 
+	alignas(CacheLineSize) std::atomic<std::size_t> head_{ 0 }; 
+	std::size_t cached_tail_{ 0 }; 
+	alignas(CacheLineSize) std::atomic<std::size_t> tail_{ 0 }; 
+	std::size_t cached_head_{ 0 }; 
+
+public:
+	explicit SpscRing(std::size_t capacity); 
+
+	bool TryPush(const T& value); 
+	template <typename Consumer>
+	std::size_t ConsumeBatch(Consumer&& consumer, std::size_t limit); 
+
+	std::size_t Capacity() const { return mask_ + 1; }
+};
+
+//--- SPSC RING 
+template <typename T>
+SpscRing<T>::SpscRing(std::size_t capacity)
+	: slots_ { std::make_unique<T[]>(std::bit_ceil(std::max<std::size_t>(capacity, 2))) }
+	, mask_ { std::bit_ceil(std::max<std::size_t>(capacity, 2)) - 1 } {}
+
+template <typename T>
+bool SpscRing<T>::TryPush(const T& value) {
+	const auto tail = tail_.load(std::memory_order_relaxed); 
+	if (tail - cached_head_ > mask_) {
+		cached_head_ = head_.load(std::memory_order_acquire); 
+		if (tail - cached_head_ > mask_) return false; 
+	}
+	slots_[tail & mask_] = value; 
+	tail_.store(tail + 1, std::memory_order_release); 
+	return true; 
+}
+
+template <typename T>
+template <typename Consumer>
+std::size_t SpscRing<T>::ConsumeBatch(Consumer&& consumer, std::size_t limit) {
+	const auto head = head_.load(std::memory_order_relaxed); 
+	if (cached_tail_ == head) cached_tail_ = tail_.load(std::memory_order_acquire); 
+
+	const auto count = std::min(cached_tail_ - head, limit); 
+	for (std::size_t i = 0; i < count; ++i) consumer(slots_[(head + i) & mask_]); 
+	head_.store(head + count, std::memory_order_release); 
+	return count; 
+}
+
+//--- L3 order event. Quantity is the amount added, reduced, executed or deleted, remaining is what rests 
+//--- afterwards. Queue position counts the orders ahead at the level for Added and Replaced. Executions 
+//--- carry the trade's event sequence, other events the book's current one 
+struct OrderEvent {
+	SequenceNumber event_sequence_; 
+	OrderId order_id_; 
+	SymbolId symbol_id_; 
+	Price price_; 
+	Quantity quantity_; 
+	Quantity remaining_; 
+	std::uint32_t queue_position_; 
+	OrderEventType type_; 
+	Side side_; 
+};
+
+using OrderEventRing = SpscRing<OrderEvent>; 
+
+//--- Outbound wire format: an 8-byte SBE-style header (block length, template, schema, version) followed by 
+//--- a fixed little-endian block. Encoders write straight into the caller's buffer and return the bytes 
+//--- written, or 0 if it does not fit. Views read fields in place 
+enum class TemplateId : std::uint16_t {
+	Execution = 1,
+	OrderAck = 2,
+	LevelUpdate = 3,
+	OrderEvent = 4
+};
+
+struct WireSchema {
+	static constexpr std::uint16_t Id = 1; 
+	static constexpr std::uint16_t Version = 2; 
+	static constexpr std::size_t HeaderSize = 8; 
+	static constexpr std::size_t ExecutionSize = 40; 
+	static constexpr std::size_t OrderAckSize = 32; 
+	static constexpr std::size_t LevelUpdateSize = 32; 
+	static constexpr std::size_t OrderEventSize = 40; 
+};
+
+template <typename T>
+void StoreLittleEndian(char* bytes, T value) {
+	using Bits = std::make_unsigned_t<T>; 
+	const auto bits = static_cast<Bits>(value); 
+	for (std::size_t i = 0; i < sizeof(T); ++i) bytes[i] = static_cast<char>(bits >> (8 * i)); 
+}
+
+template <typename T>
+T LoadLittleEndian(const char* bytes) {
+	using Bits = std::make_unsigned_t<T>; 
+	Bits bits = 0; 
+	for (std::size_t i = 0; i < sizeof(T); ++i) bits |= static_cast<Bits>(static_cast<Bits>(static_cast<unsigned char>(bytes[i])) << (8 * i)); 
+	return static_cast<T>(bits); 
+}
+
+inline char* EncodeHeader(std::span<char> buffer, TemplateId template_id, std::size_t block_length) {
+	if (buffer.size() < WireSchema::HeaderSize + block_length) return nullptr; 
+	StoreLittleEndian(buffer.data(), static_cast<std::uint16_t>(block_length)); 
+	StoreLittleEndian(buffer.data() + 2, static_cast<std::uint16_t>(template_id)); 
+	StoreLittleEndian(buffer.data() + 4, WireSchema::Id); 
+	StoreLittleEndian(buffer.data() + 6, WireSchema::Version); 
+	return buffer.data() + WireSchema::HeaderSize; 
+}
+
+//--- Both limit prices are kept since each side of a Trade carries its own, the quantity is written once 
+inline std::size_t EncodeExecution(std::span<char> buffer, SymbolId symbol_id, const Trade& trade) {
+	char* block = EncodeHeader(buffer, TemplateId::Execution, WireSchema::ExecutionSize); 
+	if (!block) return 0; 
+	StoreLittleEndian(block, trade.GetSequence()); 
+	StoreLittleEndian(block + 8, trade.GetBidTrade().order_id_); 
+	StoreLittleEndian(block + 16, trade.GetAskTrade().order_id_); 
+	StoreLittleEndian(block + 24, symbol_id); 
+	StoreLittleEndian(block + 28, trade.GetBidTrade().price_); 
+	StoreLittleEndian(block + 32, trade.GetAskTrade().price_); 
+	StoreLittleEndian(block + 36, trade.GetBidTrade().quanity_); 
+	return WireSchema::HeaderSize + WireSchema::ExecutionSize; 
+}
+
+inline std::size_t EncodeOrderAck(std::span<char> buffer, const Command& command, AckStatus status) {
+	char* block = EncodeHeader(buffer, TemplateId::OrderAck, WireSchema::OrderAckSize); 
+	if (!block) return 0; 
+	StoreLittleEndian(block, command.sequence_); 
+	StoreLittleEndian(block + 8, command.order_id_); 
+	StoreLittleEndian(block + 16, command.symbol_id_); 
+	StoreLittleEndian(block + 20, command.price_); 
+	StoreLittleEndian(block + 24, command.quantity_); 
+	StoreLittleEndian(block + 28, static_cast<std::uint8_t>(command.type_)); 
+	StoreLittleEndian(block + 29, static_cast<std::uint8_t>(command.side_)); 
+	StoreLittleEndian(block + 30, static_cast<std::uint8_t>(status)); 
+	block[31] = 0; 
+	return WireSchema::HeaderSize + WireSchema::OrderAckSize; 
+}
+
+inline std::size_t EncodeLevelUpdate(std::span<char> buffer, SequenceNumber event_sequence, SymbolId symbol_id, 
+	Side side, Price price, Quantity quantity, std::uint32_t orders, LevelAction action) {
+	char* block = EncodeHeader(buffer, TemplateId::LevelUpdate, WireSchema::LevelUpdateSize); 
+	if (!block) return 0; 
+	StoreLittleEndian(block, event_sequence); 
+	StoreLittleEndian(block + 8, symbol_id); 
+	StoreLittleEndian(block + 12, price); 
+	StoreLittleEndian(block + 16, quantity); 
+	StoreLittleEndian(block + 20, static_cast<std::uint8_t>(side)); 
+	StoreLittleEndian(block + 21, static_cast<std::uint8_t>(action)); 
+	block[22] = block[23] = 0; 
+	StoreLittleEndian(block + 24, orders); 
+	StoreLittleEndian(block + 28, std::uint32_t{ 0 }); 
+	return WireSchema::HeaderSize + WireSchema::LevelUpdateSize; 
+}
+
+inline std::size_t EncodeOrderEvent(std::span<char> buffer, const OrderEvent& event) {
+	char* block = EncodeHeader(buffer, TemplateId::OrderEvent, WireSchema::OrderEventSize); 
+	if (!block) return 0; 
+	StoreLittleEndian(block, event.event_sequence_); 
+	StoreLittleEndian(block + 8, event.order_id_); 
+	StoreLittleEndian(block + 16, event.symbol_id_); 
+	StoreLittleEndian(block + 20, event.price_); 
+	StoreLittleEndian(block + 24, event.quantity_); 
+	StoreLittleEndian(block + 28, event.remaining_); 
+	StoreLittleEndian(block + 32, event.queue_position_); 
+	StoreLittleEndian(block + 36, static_cast<std::uint8_t>(event.type_)); 
+	StoreLittleEndian(block + 37, static_cast<std::uint8_t>(event.side_)); 
+	block[38] = block[39] = 0; 
+	return WireSchema::HeaderSize + WireSchema::OrderEventSize; 
+}
+
+class MessageHeaderView {
+private:
+	const char* data_; 
+public:
+	explicit MessageHeaderView(const char* data) : data_{ data } {}
+
+	std::uint16_t GetBlockLength() const { return LoadLittleEndian<std::uint16_t>(data_); }
+	TemplateId GetTemplateId() const { return static_cast<TemplateId>(LoadLittleEndian<std::uint16_t>(data_ + 2)); }
+	std::uint16_t GetSchemaId() const { return LoadLittleEndian<std::uint16_t>(data_ + 4); }
+	std::uint16_t GetVersion() const { return LoadLittleEndian<std::uint16_t>(data_ + 6); }
+	//--- Unknown templates can be skipped by length 
+	std::size_t GetMessageSize() const { return WireSchema::HeaderSize + GetBlockLength(); }
+	const char* GetBlock() const { return data_ + WireSchema::HeaderSize; }
+};
+
+class ExecutionView {
+private:
+	const char* block_; 
+public:
+	explicit ExecutionView(const char* block) : block_{ block } {}
+
+	SequenceNumber GetSequence() const { return LoadLittleEndian<SequenceNumber>(block_); }
+	OrderId GetBidOrderId() const { return LoadLittleEndian<OrderId>(block_ + 8); }
+	OrderId GetAskOrderId() const { return LoadLittleEndian<OrderId>(block_ + 16); }
+	SymbolId GetSymbolId() const { return LoadLittleEndian<SymbolId>(block_ + 24); }
+	Price GetBidPrice() const { return LoadLittleEndian<Price>(block_ + 28); }
+	Price GetAskPrice() const { return LoadLittleEndian<Price>(block_ + 32); }
+	Quantity GetQuantity() const { return LoadLittleEndian<Quantity>(block_ + 36); }
+};
+
+class OrderAckView {
+private:
+	const char* block_; 
+public:
+	explicit OrderAckView(const char* block) : block_{ block } {}
+
+	SequenceNumber GetSequence() const { return LoadLittleEndian<SequenceNumber>(block_); }
+	OrderId GetOrderId() const { return LoadLittleEndian<OrderId>(block_ + 8); }
+	SymbolId GetSymbolId() const { return LoadLittleEndian<SymbolId>(block_ + 16); }
+	Price GetPrice() const { return LoadLittleEndian<Price>(block_ + 20); }
+	Quantity GetQuantity() const { return LoadLittleEndian<Quantity>(block_ + 24); }
+	CommandType GetCommandType() const { return static_cast<CommandType>(block_[28]); }
+	Side GetSide() const { return static_cast<Side>(block_[29]); }
+	AckStatus GetStatus() const { return static_cast<AckStatus>(block_[30]); }
+};
+
+class LevelUpdateView {
+private:
+	const char* block_; 
+public:
+	explicit LevelUpdateView(const char* block) : block_{ block } {}
+
+	SequenceNumber GetEventSequence() const { return LoadLittleEndian<SequenceNumber>(block_); }
+	SymbolId GetSymbolId() const { return LoadLittleEndian<SymbolId>(block_ + 8); }
+	Price GetPrice() const { return LoadLittleEndian<Price>(block_ + 12); }
+	Quantity GetQuantity() const { return LoadLittleEndian<Quantity>(block_ + 16); }
+	Side GetSide() const { return static_cast<Side>(block_[20]); }
+	LevelAction GetAction() const { return static_cast<LevelAction>(block_[21]); }
+	std::uint32_t GetOrders() const { return LoadLittleEndian<std::uint32_t>(block_ + 24); }
+};
+
+class OrderEventView {
+private:
+	const char* block_; 
+public:
+	explicit OrderEventView(const char* block) : block_{ block } {}
+
+	SequenceNumber GetEventSequence() const { return LoadLittleEndian<SequenceNumber>(block_); }
+	OrderId GetOrderId() const { return LoadLittleEndian<OrderId>(block_ + 8); }
+	SymbolId GetSymbolId() const { return LoadLittleEndian<SymbolId>(block_ + 16); }
+	Price GetPrice() const { return LoadLittleEndian<Price>(block_ + 20); }
+	Quantity GetQuantity() const { return LoadLittleEndian<Quantity>(block_ + 24); }
+	Quantity GetRemaining() const { return LoadLittleEndian<Quantity>(block_ + 28); }
+	std::uint32_t GetQueuePosition() const { return LoadLittleEndian<std::uint32_t>(block_ + 32); }
+	OrderEventType GetType() const { return static_cast<OrderEventType>(block_[36]); }
+	Side GetSide() const { return static_cast<Side>(block_[37]); }
+};
+
+//--- Net change to one price level over a command. Deletes carry zero quantity and orders 
+struct LevelDelta {
+	SequenceNumber event_sequence_; 
+	Side side_; 
+	Price price_; 
+	Quantity quantity_; 
+	std::uint32_t orders_; 
+	LevelAction action_; 
+};
+
+using LevelDeltas = std::vector<LevelDelta>; 
+//--- Runs on the thread mutating the book, once per command that changed at least one level. Must not throw 
+using LevelHandler = std::function<void(std::span<const LevelDelta>)>; 
+using SymbolLevelHandler = std::function<void(SymbolId, std::span<const LevelDelta>)>; 
+
+//--- Snapshots are raw little-endian records appended to a byte buffer 
+template <typename T>
+void WriteSnapshot(std::vector<char>& out, const T& value) {
+	static_assert(std::is_trivially_copyable_v<T>); 
+	const auto* bytes = reinterpret_cast<const char*>(&value); 
+	out.insert(out.end(), bytes, bytes + sizeof(T)); 
+}
+
+//--- Bounds-checked cursor over snapshot bytes 
+class SnapshotReader {
+private:
+	std::span<const char> bytes_; 
+	std::size_t offset_{ 0 }; 
+
+public:
+	explicit SnapshotReader(std::span<const char> bytes) : bytes_{ bytes } {}
+
+	template <typename T>
+	T Read() {
+		static_assert(std::is_trivially_copyable_v<T>); 
+		if (bytes_.size() - offset_ < sizeof(T)) throw std::runtime_error("Snapshot is truncated"); 
+		T value; 
+		std::memcpy(&value, bytes_.data() + offset_, sizeof(T)); 
+		offset_ += sizeof(T); 
+		return value; 
+	}
+	std::size_t Offset() const { return offset_; }
+	std::size_t Remaining() const { return bytes_.size() - offset_; }
+};
+
+struct BookSnapshotHeader {
+	std::uint64_t orders_; 
+	std::uint64_t arrivals_; 
+	SequenceNumber event_sequence_; 
+	std::uint8_t self_trade_prevention_; 
+	std::uint8_t trading_phase_; 
+};
+
+//--- Orders are written level by level in priority order, so restore only ever appends 
+struct SnapshotOrder {
+	OrderId order_id_; 
+	std::uint64_t arrival_; 
+	Price price_; 
+	Quantity initial_quantity_; 
+	Quantity remaining_quantity_; 
+	Quantity minimum_quantity_; 
+	OwnerId owner_id_; 
+	std::uint8_t order_type_; 
+	std::uint8_t side_; 
+	std::uint8_t post_only_; 
+};
+
 class OrderBook {
 private:
+	struct Level {
+		OrderPointers orders_; 
+		Quantity quantity_{ 0 }; 
+		//--- Command generation that last recorded this level's before-state 
+		std::uint64_t touched_{ 0 }; 
+	};
+	struct TouchedLevel {
+		Side side_; 
+		Price price_; 
+		Quantity quantity_; 
+		std::uint32_t orders_; 
+		bool existed_; 
+	};
+	//--- Public mutators open a scope. Deltas go out when the outermost one closes, so nested calls coalesce 
+	class LevelScope {
+	private:
+		OrderBook& book_; 
+	public:
+		explicit LevelScope(OrderBook& book) : book_{ book } { ++book_.level_scopes_; }
+		~LevelScope() { if (--book_.level_scopes_ == 0) book_.EmitLevelDeltas(); }
+		LevelScope(const LevelScope&) = delete; 
+		LevelScope& operator=(const LevelScope&) = delete; 
+	};
 	struct OrderEntry {
 		OrderPointer order_{ nullptr };
 		OrderPointers::iterator location_; 
+		Level* level_{ nullptr }; 
+		//--- Intrusive per-owner list, entries are stable inside orders_ 
+		OrderEntry* owner_prev_{ nullptr }; 
+		OrderEntry* owner_next_{ nullptr }; 
+		std::uint64_t quote_generation_{ 0 }; 
 	};
-	std::map<Price, OrderPointers, std::greater<Price>> bids_; 
-	std::map<Price, OrderPointers, std::less<Price>> asks_; 
+	std::map<Price, Level, std::greater<Price>> bids_; 
+	std::map<Price, Level, std::less<Price>> asks_; 
 	std::unordered_map<OrderId, OrderEntry> orders_; 
+	std::unordered_map<OwnerId, OrderEntry*> owners_; 
+	SelfTradePrevention self_trade_prevention_; 
+	TradingPhase trading_phase_{ TradingPhase::Continuous }; 
+	std::uint64_t arrivals_{ 0 }; 
+	std::uint64_t quote_generations_{ 0 }; 
+	//--- Per-book event counter, identical across replicas fed the same command sequence 
+	SequenceNumber event_sequence_{ 0 }; 
+	std::shared_ptr<Seqlock<TopOfBook>> top_of_book_; 
+
+	//--- Scratch state for Apply(), allocated on first use so idle books stay small 
+	struct BatchState {
+		std::unordered_map<OrderId, std::size_t> open_adds_; 
+		std::vector<bool> transient_; 
+		std::unordered_map<OrderId, OrderPointer> held_; 
+		Price held_best_bid_{ std::numeric_limits<Price>::min() }; 
+		Price held_best_ask_{ std::numeric_limits<Price>::max() }; 
+	};
+	std::unique_ptr<BatchState> batch_; 
+	Price best_bid_{ std::numeric_limits<Price>::min() }; 
+	Price best_ask_{ std::numeric_limits<Price>::max() }; 
+	std::uint32_t level_scopes_{ 0 }; 
+	std::uint64_t rejected_orders_{ 0 }; 
+
+	//--- Market data outputs, allocated by the first subscription so books without subscribers stay small 
+	struct Feeds {
+		std::unique_ptr<DepthBuffer> depth_; 
+		bool depth_dirty_{ false }; 
+		LevelHandler on_levels_; 
+		std::vector<TouchedLevel> touched_levels_; 
+		LevelDeltas level_deltas_; 
+		std::uint64_t level_generation_{ 1 }; 
+		OrderEventRing* order_events_{ nullptr }; 
+		SymbolId order_event_symbol_{ 0 }; 
+		std::uint64_t dropped_order_events_{ 0 }; 
+	};
+	std::unique_ptr<Feeds> feeds_; 
 		 
+	Feeds& GetFeeds(); 
+	void UpdateBestPrices(); 
+	void TouchLevel(Side side, Price price, Level& level); 
+	void EmitLevelDeltas(); 
+	void EmitOrderEvent(OrderEventType type, const Order& order, Quantity quantity, 
+		std::uint32_t queue_position = 0, SequenceNumber event_sequence = 0); 
+	void LinkOwner(OrderEntry& entry); 
+	void UnlinkOwner(OrderEntry& entry); 
+	void EraseOrder(OrderId order_id); 
+	OrderEntry& InsertOrder(const OrderPointer& order); 
+	OrderEntry& PlaceOrder(const OrderPointer& order); 
+	bool ValidateOrder(Order& order) const; 
+	void MarkTransientAdds(std::span<const Command> commands); 
+	void HoldOrder(const OrderPointer& order); 
+	bool CrossesHeld(Side side, Price price) const; 
+	void FlushHeld(); 
+	void RequoteOrder(OrderEntry& entry, Price price, Quantity quantity); 
+	template <typename Levels>
+	std::size_t CancelLevels(Levels& levels, typename Levels::iterator first, typename Levels::iterator last); 
 	bool CanMatch(Side side, Price price) const; 
+	bool CanFillMinimum(Side side, Price price, Quantity quantity) const; 
+	bool IsSelfTrade(const Order& bid, const Order& ask) const; 
+	void PreventSelfTrade(Level& bids, Level& asks); 
 	Trades MatchOrders(); 
+	void UncrossOnce(Trades& trades); 
 
 public: 
+	//--- Publishes L1 into the given seqlock, or into one of its own 
+	explicit OrderBook(SelfTradePrevention self_trade_prevention = SelfTradePrevention::None, 
+		std::shared_ptr<Seqlock<TopOfBook>> top_of_book = nullptr); 
+
 	Trades AddOrder(OrderPointer order);
 	void CancelOrder(OrderId order_id); 
+	//--- Takes quantity off a resting order in place, keeping its queue position. Reducing to zero cancels it 
+	void ReduceOrder(OrderId order_id, Quantity quantity); 
 	Trades MatchOrder(OrderModify order); 
 
+	//--- Mass cancels unlink in bulk and drop emptied levels once, returning the number of orders cancelled 
+	std::size_t MassCancel(OwnerId owner_id); 
+	std::size_t MassCancel(Side side); 
+	std::size_t MassCancel(Side side, Price low, Price high); 
+
+	//--- Replaces the owner's whole quote set, reusing resting order slots and matching once at the end 
+	Trades MassQuote(OwnerId owner_id, const Quotes& quotes); 
+
+	//--- Applies a batch of commands with the same outcome as one call each, returning all trades together 
+	Trades Apply(std::span<const Command> commands); 
+
+	//--- Call auction: orders rest without matching until Uncross() 
+	void BeginAuction() { trading_phase_ = TradingPhase::Auction; }
+	Trades Uncross(); 
+
 	std::size_t Size() const { return orders_.size(); }
+	//--- Frees the order storage of an empty book, returning false if it held none. Settings, sequences and 
+	//--- subscribers are kept 
+	bool Compact(); 
+	bool IsCompact() const { return orders_.bucket_count() <= 1 && owners_.bucket_count() <= 1 && !batch_; }
+	//--- Orders placed over the book's lifetime, unchanged while the book sits idle 
+	std::uint64_t GetArrivals() const { return arrivals_; }
+	bool Contains(OrderId order_id) const { return orders_.contains(order_id); }
+	const Order* FindOrder(OrderId order_id) const; 
+	std::size_t BidLevels() const { return bids_.size(); }
+	std::size_t AskLevels() const { return asks_.size(); }
+	TradingPhase GetTradingPhase() const { return trading_phase_; }
+	SequenceNumber GetEventSequence() const { return event_sequence_; }
+	//--- Orders refused by validation: duplicate ids, unmatched FillAndKill, post-only and minimum quantity rejects 
+	std::uint64_t GetRejectedOrders() const { return rejected_orders_; }
+
+	//--- Safe to call from any thread while the owning thread mutates the book 
+	TopOfBook ReadTopOfBook() const { return top_of_book_->Load(); }
+	TopOfBookHandle GetTopOfBookHandle() const { return top_of_book_; }
+
+	//--- Top-N depth for reader threads, refreshed by PublishDepth() at batch boundaries. 
+	//--- EnableDepth must be called on the owning thread before readers start 
+	void EnableDepth(std::size_t levels); 
+	bool HasDepth() const { return feeds_ && feeds_->depth_; }
+	bool PublishDepth(); 
+	template <typename Reader>
+	bool ReadDepth(Reader&& reader) const; 
+	//--- Copies the best levels per side into the caller's vectors, reusing their capacity 
+	void CopyDepth(std::size_t levels, LevelInfos& bids, LevelInfos& asks) const; 
+	//--- Coalesced L2 deltas, one handler call per command. Tracking costs nothing while no handler is set 
+	void SetLevelHandler(LevelHandler on_levels); 
+	//--- L3 events are pushed into the ring from the mutating thread, tagged with the given symbol. A full ring 
+	//--- drops events rather than stall matching 
+	void SetOrderEventRing(OrderEventRing* order_events, SymbolId symbol_id = 0); 
+	std::uint64_t GetDroppedOrderEvents() const { return feeds_ ? feeds_->dropped_order_events_ : 0; }
+	SelfTradePrevention GetSelfTradePrevention() const { return self_trade_prevention_; }
+	void SetSelfTradePrevention(SelfTradePrevention self_trade_prevention) { self_trade_prevention_ = self_trade_prevention; }
 
 	OrderBookLevelInfos GetOrderInfos() const; 
+
+	//--- Full resting state in priority order. Restore replaces the book's contents without matching 
+	void Serialize(std::vector<char>& out) const; 
+	void Restore(SnapshotReader& reader); 
+	//--- Reads past one book's snapshot, throwing if Restore would reject it 
+	static void CheckSnapshot(SnapshotReader& reader); 
 };
 
+OrderBook::OrderBook(SelfTradePrevention self_trade_prevention, std::shared_ptr<Seqlock<TopOfBook>> top_of_book)
+	: self_trade_prevention_ { self_trade_prevention }
+	, top_of_book_ { top_of_book ? std::move(top_of_book) : std::make_shared<Seqlock<TopOfBook>>() } {
+	UpdateBestPrices(); 
+}
+
 //--- PRIVATE 
+OrderBook::Feeds& OrderBook::GetFeeds() {
+	if (!feeds_) feeds_ = std::make_unique<Feeds>(); 
+	return *feeds_; 
+}
+
+void OrderBook::UpdateBestPrices() {
+	//--- Empty sides hold sentinels so CanMatch stays a single comparison 
+	best_bid_ = bids_.empty() ? std::numeric_limits<Price>::min() : bids_.begin()->first; 
+	best_ask_ = asks_.empty() ? std::numeric_limits<Price>::max() : asks_.begin()->first; 
+
+	//--- Runs after every mutation, so the published L1 is never older than the last command 
+	top_of_book_->Store(TopOfBook{ 
+		best_bid_, bids_.empty() ? 0 : bids_.begin()->second.quantity_, 
+		best_ask_, asks_.empty() ? 0 : asks_.begin()->second.quantity_, 
+		event_sequence_ }); 
+	if (feeds_) feeds_->depth_dirty_ = true; 
+}
+
+void OrderBook::TouchLevel(Side side, Price price, Level& level) {
+	//--- Called before a level changes, only the first touch per command records the before-state 
+	if (!feeds_ || !feeds_->on_levels_ || level.touched_ == feeds_->level_generation_) return; 
+	level.touched_ = feeds_->level_generation_; 
+	feeds_->touched_levels_.push_back(TouchedLevel{ side, price, level.quantity_, 
+		static_cast<std::uint32_t>(level.orders_.size()), !level.orders_.empty() }); 
+}
+
+void OrderBook::EmitLevelDeltas() {
+	if (!feeds_ || feeds_->touched_levels_.empty()) return; 
+	auto& touched_levels = feeds_->touched_levels_; 
+	auto& level_deltas = feeds_->level_deltas_; 
+	++feeds_->level_generation_; 
+
+	//--- A level emptied and recreated in one command is recorded twice, the first record holds the true before-state 
+	std::stable_sort(touched_levels.begin(), touched_levels.end(), [](const TouchedLevel& left, const TouchedLevel& right) {
+		return std::tie(left.side_, left.price_) < std::tie(right.side_, right.price_); 
+	}); 
+	level_deltas.clear(); 
+	for (std::size_t i = 0; i < touched_levels.size(); ++i) {
+		const auto& touched = touched_levels[i]; 
+		if (i && touched_levels[i - 1].side_ == touched.side_ && touched_levels[i - 1].price_ == touched.price_) continue; 
+
+		const Level* level = nullptr; 
+		if (touched.side_ == Side::Buy) {
+			auto found = bids_.find(touched.price_); 
+			if (found != bids_.end()) level = &found->second; 
+		}
+		else {
+			auto found = asks_.find(touched.price_); 
+			if (found != asks_.end()) level = &found->second; 
+		}
+		const auto quantity = level ? level->quantity_ : 0; 
+		const auto orders = level ? static_cast<std::uint32_t>(level->orders_.size()) : 0; 
+
+		if (!orders) {
+			if (touched.existed_) level_deltas.push_back(LevelDelta{ event_sequence_, touched.side_, touched.price_, 0, 0, LevelAction::Delete }); 
+		}
+		else if (!touched.existed_) level_deltas.push_back(LevelDelta{ event_sequence_, touched.side_, touched.price_, quantity, orders, LevelAction::New }); 
+		else if (quantity != touched.quantity_ || orders != touched.orders_) 
+			level_deltas.push_back(LevelDelta{ event_sequence_, touched.side_, touched.price_, quantity, orders, LevelAction::Change }); 
+	}
+	touched_levels.clear(); 
+	if (!level_deltas.empty() && feeds_->on_levels_) feeds_->on_levels_(level_deltas); 
+}
+
+void OrderBook::EmitOrderEvent(OrderEventType type, const Order& order, Quantity quantity, 
+	std::uint32_t queue_position, SequenceNumber event_sequence) {
+	if (!feeds_ || !feeds_->order_events_) return; 
+	const OrderEvent event{ event_sequence ? event_sequence : event_sequence_, order.GetOrderId(), feeds_->order_event_symbol_, order.GetPrice(), 
+		quantity, type == OrderEventType::Deleted ? 0 : order.GetRemainingQuantity(), queue_position, type, order.GetSide() }; 
+	if (!feeds_->order_events_->TryPush(event)) ++feeds_->dropped_order_events_; 
+}
+
+void OrderBook::LinkOwner(OrderEntry& entry) {
+	const auto owner_id = entry.order_->GetOwnerId(); 
+	if (owner_id == Constants::NoOwner) return; 
+
+	auto& head = owners_[owner_id]; 
+	entry.owner_next_ = head; 
+	if (head) head->owner_prev_ = &entry; 
+	head = &entry; 
+}
+
+void OrderBook::UnlinkOwner(OrderEntry& entry) {
+	const auto owner_id = entry.order_->GetOwnerId(); 
+	if (owner_id == Constants::NoOwner) return; 
+
+	if (entry.owner_next_) entry.owner_next_->owner_prev_ = entry.owner_prev_; 
+	if (entry.owner_prev_) entry.owner_prev_->owner_next_ = entry.owner_next_; 
+	else if (entry.owner_next_) owners_[owner_id] = entry.owner_next_; 
+	else owners_.erase(owner_id); 
+}
+
+void OrderBook::EraseOrder(OrderId order_id) {
+	auto entry = orders_.find(order_id); 
+	UnlinkOwner(entry->second); 
+	orders_.erase(entry); 
+}
+
+OrderBook::OrderEntry& OrderBook::InsertOrder(const OrderPointer& order) {
+	order->SetArrival(++arrivals_); 
+	return PlaceOrder(order); 
+}
+
+OrderBook::OrderEntry& OrderBook::PlaceOrder(const OrderPointer& order) {
+	//--- Levels are kept in arrival order, a fresh arrival lands at the back without walking 
+	auto& level = order->GetSide() == Side::Buy ? bids_[order->GetPrice()] : asks_[order->GetPrice()]; 
+	TouchLevel(order->GetSide(), order->GetPrice(), level); 
+	auto position = level.orders_.end(); 
+	auto ahead = static_cast<std::uint32_t>(level.orders_.size()); 
+	while (position != level.orders_.begin() && (*std::prev(position))->GetArrival() > order->GetArrival()) {
+		--position; 
+		--ahead; 
+	}
+	auto location = level.orders_.insert(position, order); 
+	level.quantity_ += order->GetRemainingQuantity(); 
+	EmitOrderEvent(OrderEventType::Added, *order, order->GetRemainingQuantity(), ahead); 
+
+	auto [entry, _] = orders_.insert({ order->GetOrderId(), OrderEntry {order, location, &level} }); 
+	LinkOwner(entry->second); 
+	return entry->second; 
+}
+
+void OrderBook::RequoteOrder(OrderEntry& entry, Price price, Quantity quantity) {
+	auto& order = *entry.order_; 
+	auto& level = *entry.level_; 
+	TouchLevel(order.GetSide(), order.GetPrice(), level); 
+	level.quantity_ -= order.GetRemainingQuantity(); 
+
+	if (price == order.GetPrice()) {
+		//--- Reducing keeps queue priority, increasing sends the order to the back of its level 
+		const auto previous = order.GetRemainingQuantity(); 
+		if (quantity > previous) {
+			level.orders_.splice(level.orders_.end(), level.orders_, entry.location_); 
+			order.SetArrival(++arrivals_); 
+		}
+		order.Requote(price, quantity); 
+		level.quantity_ += quantity; 
+		if (quantity > previous) EmitOrderEvent(OrderEventType::Replaced, order, quantity, static_cast<std::uint32_t>(level.orders_.size() - 1)); 
+		else if (quantity < previous) EmitOrderEvent(OrderEventType::Reduced, order, previous - quantity); 
+		return; 
+	}
+
+	//--- Splicing moves the existing list node, so the index entry and its iterator stay valid 
+	auto& target = order.GetSide() == Side::Buy ? bids_[price] : asks_[price]; 
+	TouchLevel(order.GetSide(), price, target); 
+	target.orders_.splice(target.orders_.end(), level.orders_, entry.location_); 
+	target.quantity_ += quantity; 
+	entry.level_ = &target; 
+	if (level.orders_.empty()) {
+		if (order.GetSide() == Side::Buy) bids_.erase(order.GetPrice()); 
+		else asks_.erase(order.GetPrice()); 
+	}
+	order.Requote(price, quantity); 
+	order.SetArrival(++arrivals_); 
+	EmitOrderEvent(OrderEventType::Replaced, order, quantity, static_cast<std::uint32_t>(target.orders_.size() - 1)); 
+}
+
+template <typename Levels>
+std::size_t OrderBook::CancelLevels(Levels& levels, typename Levels::iterator first, typename Levels::iterator last) {
+	std::size_t cancelled = 0; 
+	const auto side = std::is_same_v<Levels, decltype(bids_)> ? Side::Buy : Side::Sell; 
+	for (auto level = first; level != last; ++level) {
+		TouchLevel(side, level->first, level->second); 
+		for (const auto& order : level->second.orders_) {
+			EmitOrderEvent(OrderEventType::Deleted, *order, order->GetRemainingQuantity()); 
+			EraseOrder(order->GetOrderId()); 
+		}
+		cancelled += level->second.orders_.size(); 
+	}
+	levels.erase(first, last); 
+	UpdateBestPrices(); 
+	return cancelled; 
+}
+
 bool OrderBook::CanMatch(Side side, Price price) const {
-	if (side == Side::Buy) {
-		if (asks_.empty()) return false; 
+	return side == Side::Buy ? price >= best_ask_ : price <= best_bid_; 
+}
 
-		const auto& [best_ask, _] = *asks_.begin();
-		return price >= best_ask; 
+bool OrderBook::CanFillMinimum(Side side, Price price, Quantity quantity) const {
+	//--- Sums aggregate level quantity over the crossing levels only, stopping once the minimum is reached 
+	std::uint64_t available = 0; 
+	if (side == Side::Buy) {
+		for (const auto& [ask_price, level] : asks_) {
+			if (ask_price > price) break; 
+			available += level.quantity_; 
+			if (available >= quantity) return true; 
+		}
 	}
 	else {
-		if (bids_.empty()) return false;
+		for (const auto& [bid_price, level] : bids_) {
+			if (bid_price < price) break; 
+			available += level.quantity_; 
+			if (available >= quantity) return true; 
+		}
+	}
+	return false; 
+}
 
-		const auto& [best_bid, _] = *bids_.begin(); 
-		return price <= best_bid; 
+bool OrderBook::IsSelfTrade(const Order& bid, const Order& ask) const {
+	//--- Integer owner comparison keeps the check O(1) per potential fill 
+	return bid.GetOwnerId() == ask.GetOwnerId()
+		&& bid.GetOwnerId() != Constants::NoOwner
+		&& self_trade_prevention_ != SelfTradePrevention::None; 
+}
+
+void OrderBook::PreventSelfTrade(Level& bids, Level& asks) {
+	auto bid = bids.orders_.front(); 
+	auto ask = asks.orders_.front(); 
+	const bool bid_is_newest = bid->GetArrival() > ask->GetArrival(); 
+	const auto bid_open = bid->GetRemainingQuantity(), ask_open = ask->GetRemainingQuantity(); 
+	bool cancel_bid = false, cancel_ask = false; 
+
+	switch (self_trade_prevention_) {
+	case SelfTradePrevention::CancelNewest:
+		cancel_bid = bid_is_newest; 
+		cancel_ask = !bid_is_newest; 
+		break; 
+	case SelfTradePrevention::CancelOldest:
+		cancel_bid = !bid_is_newest; 
+		cancel_ask = bid_is_newest; 
+		break; 
+	case SelfTradePrevention::CancelBoth:
+		cancel_bid = cancel_ask = true; 
+		break; 
+	case SelfTradePrevention::Decrement: {
+		//--- Smaller order is cancelled, larger order is decremented by the same amount 
+		Quantity quantity = std::min(bid->GetRemainingQuantity(), ask->GetRemainingQuantity()); 
+		bid->Reduce(quantity); 
+		ask->Reduce(quantity); 
+		bids.quantity_ -= quantity; 
+		asks.quantity_ -= quantity; 
+		cancel_bid = bid->IsFilled(); 
+		cancel_ask = ask->IsFilled(); 
+		if (!cancel_bid) EmitOrderEvent(OrderEventType::Reduced, *bid, quantity); 
+		if (!cancel_ask) EmitOrderEvent(OrderEventType::Reduced, *ask, quantity); 
+		break; 
+	}
+	default:
+		break; 
+	}
+
+	//--- A decremented-away order reports its whole open quantity as deleted 
+	if (cancel_bid) {
+		EmitOrderEvent(OrderEventType::Deleted, *bid, bid_open); 
+		bids.quantity_ -= bid->GetRemainingQuantity(); 
+		bids.orders_.pop_front(); 
+		EraseOrder(bid->GetOrderId()); 
+	}
+	if (cancel_ask) {
+		EmitOrderEvent(OrderEventType::Deleted, *ask, ask_open); 
+		asks.quantity_ -= ask->GetRemainingQuantity(); 
+		asks.orders_.pop_front(); 
+		EraseOrder(ask->GetOrderId()); 
 	}
 }
 
@@ -195,46 +1210,62 @@ Trades OrderBook::MatchOrders() {
 	while (true) {
 		if (bids_.empty() || asks_.empty()) break;
 
-		auto& [bid_price, bids] = *bids_.begin(); 
-		auto& [ask_price, asks] = *asks_.begin(); 
+		auto& [bid_price, bid_level] = *bids_.begin(); 
+		auto& [ask_price, ask_level] = *asks_.begin(); 
 
 		if (bid_price < ask_price) break; 
+		TouchLevel(Side::Buy, bid_price, bid_level); 
+		TouchLevel(Side::Sell, ask_price, ask_level); 
 
+		auto& bids = bid_level.orders_; 
+		auto& asks = ask_level.orders_; 
 		while (bids.size() && asks.size()) {
-			auto& bid = bids.front();
-			auto& ask = asks.front(); 
+			auto bid = bids.front();
+			auto ask = asks.front(); 
+
+			if (IsSelfTrade(*bid, *ask)) {
+				PreventSelfTrade(bid_level, ask_level); 
+				continue; 
+			}
 
 			Quantity quantity = std::min(bid->GetRemainingQuantity(), ask->GetRemainingQuantity()); 
 			bid->Fill(quantity); 
 			ask->Fill(quantity); 
+			bid_level.quantity_ -= quantity; 
+			ask_level.quantity_ -= quantity; 
+			const auto sequence = ++event_sequence_; 
+			EmitOrderEvent(OrderEventType::Executed, *bid, quantity, 0, sequence); 
+			EmitOrderEvent(OrderEventType::Executed, *ask, quantity, 0, sequence); 
 
 			if (bid->IsFilled()) {
 				bids.pop_front();
-				orders_.erase(bid->GetOrderId()); 
+				EraseOrder(bid->GetOrderId()); 
 			}
 			if (ask->IsFilled()) {
 				asks.pop_front();
-				orders_.erase(ask->GetOrderId()); 
+				EraseOrder(ask->GetOrderId()); 
 			}
-			if (bids.empty()) bids_.erase(bid_price);
-			if (asks.empty()) asks_.erase(ask_price); 
 
 			trades.push_back(Trade(
 				TradeInfo(bid->GetOrderId(), bid->GetPrice(), quantity),
-				TradeInfo(ask->GetOrderId(), ask->GetPrice(), quantity)
+				TradeInfo(ask->GetOrderId(), ask->GetPrice(), quantity),
+				sequence
 			)); 
 		}
+		if (bids.empty()) bids_.erase(bids_.begin());
+		if (asks.empty()) asks_.erase(asks_.begin()); 
 	}
+	UpdateBestPrices(); 
 	if (!bids_.empty()) {
 		auto& [_, bids] = *bids_.begin(); 
-		auto& order = bids.front(); 
+		auto& order = bids.orders_.front(); 
 		if (order->GetOrderType() == OrderType::GoodTillCancel) {
 			//CancelOrder(order->GetOrderId()); 
 		}
 	}
 	if (!asks_.empty()) {
 		auto& [_, asks] = *asks_.begin();
-		auto& order = asks.front(); 
+		auto& order = asks.orders_.front(); 
 
 		if (order->GetOrderType() == OrderType::FillAndKill) {
 			//CancelOrder(order->GetOrderId()); 
@@ -243,81 +1274,3174 @@ Trades OrderBook::MatchOrders() {
 	return trades; 
 }
 
-Trades OrderBook::AddOrder(OrderPointer order) {
-	if (orders_.contains(order->GetOrderId())) {
-		return {}; 
-	}
+bool OrderBook::ValidateOrder(Order& order) const {
+	//--- Flag checks run before any mutation, so rejected orders never reach the book 
+	if (order.GetRemainingQuantity() == 0) return false; 
 
-	if (order->GetOrderType() == OrderType::FillAndKill && !CanMatch(order->GetSide(), order->GetPrice())) {
-		std::cout << "Ord Type Error" << std::endl;
-		return {};
+	if (trading_phase_ == TradingPhase::Continuous && order.GetPostOnly() != PostOnly::None
+		&& CanMatch(order.GetSide(), order.GetPrice())) {
+		if (order.GetPostOnly() == PostOnly::Reject) return false; 
+		order.Reprice(order.GetSide() == Side::Buy ? best_ask_ - 1 : best_bid_ + 1); 
 	}
 
-	OrderPointers::iterator iterator; 
-	if (order->GetSide() == Side::Buy) {
-		auto& orders = bids_[order->GetPrice()]; 
-		orders.push_back(order);
-		iterator = std::next(orders.begin(), orders.size() - 1); 
+	if (trading_phase_ == TradingPhase::Continuous && order.GetMinimumQuantity()
+		&& (order.GetMinimumQuantity() > order.GetRemainingQuantity()
+			|| !CanMatch(order.GetSide(), order.GetPrice())
+			|| !CanFillMinimum(order.GetSide(), order.GetPrice(), order.GetMinimumQuantity()))) {
+		return false; 
 	}
-	else {
-		auto& orders = asks_[order->GetPrice()]; 
-		orders.push_back(order);
-		iterator = std::next(orders.begin(), orders.size() - 1); 
 
+	if (orders_.contains(order.GetOrderId())) {
+		return false; 
 	}
-	orders_.insert({ order->GetOrderId(), OrderEntry {order, iterator} }); 
-	std::cout << "Success" << std::endl; 
-	return MatchOrders(); 
-}
-
-void OrderBook::CancelOrder(OrderId order_id) {
-	if (!orders_.contains(order_id)) return;
 
-	const auto& [order, iterator] = orders_.at(order_id);
-	orders_.erase(order_id);
+	if (order.GetOrderType() == OrderType::FillAndKill && !CanMatch(order.GetSide(), order.GetPrice())) {
+		return false;
+	}
 
-	if (order->GetSide() == Side::Sell) {
-		auto price = order->GetPrice();
-		auto& orders = asks_.at(price);
-		orders.erase(iterator);
-		if (orders.empty()) asks_.erase(price);
+	//--- Nothing executes before the uncross, so there is nothing for FillAndKill to hit 
+	if (order.GetOrderType() == OrderType::FillAndKill && trading_phase_ == TradingPhase::Auction) {
+		return false; 
 	}
-	else {
-		auto price = order->GetPrice();
-		auto& orders = bids_.at(price);
-		orders.erase(iterator);
-		if (orders.empty()) bids_.erase(price);
+	return true; 
+}
+
+void OrderBook::MarkTransientAdds(std::span<const Command> commands) {
+	//--- An add is transient when the batch cancels it later with no modify or re-add of the id in between 
+	auto& batch = *batch_; 
+	batch.open_adds_.clear(); 
+	batch.transient_.assign(commands.size(), false); 
+	for (std::size_t i = 0; i < commands.size(); ++i) {
+		const auto& command = commands[i]; 
+		if (command.type_ == CommandType::Add) {
+			batch.open_adds_[command.order_id_] = i; 
+			continue; 
+		}
+		auto open = batch.open_adds_.find(command.order_id_); 
+		if (open == batch.open_adds_.end()) continue; 
+		if (command.type_ == CommandType::Cancel) batch.transient_[open->second] = true; 
+		batch.open_adds_.erase(open); 
 	}
+}
 
+void OrderBook::HoldOrder(const OrderPointer& order) {
+	//--- The arrival is taken now so a flush can still place the order at its true queue position 
+	auto& batch = *batch_; 
+	order->SetArrival(++arrivals_); 
+	batch.held_.insert({ order->GetOrderId(), order }); 
+	if (order->GetSide() == Side::Buy) batch.held_best_bid_ = std::max(batch.held_best_bid_, order->GetPrice()); 
+	else batch.held_best_ask_ = std::min(batch.held_best_ask_, order->GetPrice()); 
 }
 
-Trades OrderBook::MatchOrder(OrderModify order) {
-	if (!orders_.contains(order.GetOrderId())) return { };
+bool OrderBook::CrossesHeld(Side side, Price price) const {
+	return side == Side::Buy ? price >= batch_->held_best_ask_ : price <= batch_->held_best_bid_; 
+}
 
-	const auto& [existing_order, _] = orders_.at(order.GetOrderId()); 
-	CancelOrder(order.GetOrderId()); 
-	return AddOrder(order.ToOrderPointer(existing_order->GetOrderType())); 
+void OrderBook::FlushHeld() {
+	//--- Held orders become visible before anything could trade with them or price off them 
+	auto& batch = *batch_; 
+	for (const auto& [_, order] : batch.held_) PlaceOrder(order); 
+	batch.held_.clear(); 
+	batch.held_best_bid_ = std::numeric_limits<Price>::min(); 
+	batch.held_best_ask_ = std::numeric_limits<Price>::max(); 
+	UpdateBestPrices(); 
 }
 
-OrderBookLevelInfos OrderBook::GetOrderInfos() const {
-	LevelInfos bid_infos, ask_infos; 
-	bid_infos.reserve(orders_.size()); 
-	ask_infos.reserve(orders_.size()); 
-	
-	auto CreateLevelInfos = [](Price price, const OrderPointers& orders) {
-		return LevelInfo{ price, std::accumulate(orders.begin(), orders.end(), (Quantity)0,
-			[](Quantity running_sum, const OrderPointer& order)
-			{ return running_sum + order->GetRemainingQuantity(); }) };
+Trades OrderBook::Apply(std::span<const Command> commands) {
+	LevelScope scope{ *this }; 
+	if (!batch_) batch_ = std::make_unique<BatchState>(); 
+	MarkTransientAdds(commands); 
+
+	Trades trades; 
+	auto Append = [&trades](Trades&& matched) { trades.insert(trades.end(), matched.begin(), matched.end()); }; 
+	for (std::size_t i = 0; i < commands.size(); ++i) {
+		const auto& command = commands[i]; 
+		switch (command.type_) {
+		case CommandType::Add: {
+			if (CrossesHeld(command.side_, command.price_)) FlushHeld(); 
+			auto order = MakeOrder(command); 
+			if (batch_->held_.contains(command.order_id_) || !ValidateOrder(*order)) {
+				++rejected_orders_; 
+				break; 
+			}
+
+			//--- Only an order that crosses needs the match loop, a transient resting order skips the book entirely 
+			const bool crosses = trading_phase_ == TradingPhase::Continuous && CanMatch(order->GetSide(), order->GetPrice()); 
+			if (!crosses && batch_->transient_[i]) {
+				HoldOrder(order); 
+				break; 
+			}
+			InsertOrder(order); 
+			if (crosses) Append(MatchOrders()); 
+			else UpdateBestPrices(); 
+			break; 
+		}
+		case CommandType::Cancel:
+			if (!batch_->held_.erase(command.order_id_)) CancelOrder(command.order_id_); 
+			break; 
+		case CommandType::Modify:
+			if (CrossesHeld(command.side_, command.price_)) FlushHeld(); 
+			Append(MatchOrder(OrderModify(command.order_id_, command.side_, command.price_, command.quantity_))); 
+			break; 
+		}
+	}
+	if (!batch_->held_.empty()) FlushHeld(); 
+	PublishDepth(); 
+	return trades; 
+}
+
+Trades OrderBook::AddOrder(OrderPointer order) {
+	LevelScope scope{ *this }; 
+	if (!ValidateOrder(*order)) {
+		++rejected_orders_; 
+		return {}; 
+	}
+
+	InsertOrder(order); 
+	if (trading_phase_ == TradingPhase::Auction) {
+		UpdateBestPrices(); 
+		return {}; 
+	}
+	return MatchOrders(); 
+}
+
+void OrderBook::CancelOrder(OrderId order_id) {
+	LevelScope scope{ *this }; 
+	auto entry = orders_.find(order_id); 
+	if (entry == orders_.end()) return;
+
+	const auto order = entry->second.order_; 
+	const auto iterator = entry->second.location_; 
+	EmitOrderEvent(OrderEventType::Deleted, *order, order->GetRemainingQuantity()); 
+	UnlinkOwner(entry->second); 
+	orders_.erase(entry);
+
+	if (order->GetSide() == Side::Sell) {
+		auto price = order->GetPrice();
+		auto& level = asks_.at(price);
+		TouchLevel(Side::Sell, price, level); 
+		level.orders_.erase(iterator);
+		level.quantity_ -= order->GetRemainingQuantity(); 
+		if (level.orders_.empty()) asks_.erase(price);
+	}
+	else {
+		auto price = order->GetPrice();
+		auto& level = bids_.at(price);
+		TouchLevel(Side::Buy, price, level); 
+		level.orders_.erase(iterator);
+		level.quantity_ -= order->GetRemainingQuantity(); 
+		if (level.orders_.empty()) bids_.erase(price);
+	}
+	UpdateBestPrices(); 
+
+}
+
+void OrderBook::ReduceOrder(OrderId order_id, Quantity quantity) {
+	LevelScope scope{ *this }; 
+	auto entry = orders_.find(order_id); 
+	if (entry == orders_.end()) return; 
+
+	auto& order = *entry->second.order_; 
+	if (quantity >= order.GetRemainingQuantity()) {
+		CancelOrder(order_id); 
+		return; 
+	}
+	TouchLevel(order.GetSide(), order.GetPrice(), *entry->second.level_); 
+	order.Reduce(quantity); 
+	entry->second.level_->quantity_ -= quantity; 
+	EmitOrderEvent(OrderEventType::Reduced, order, quantity); 
+	UpdateBestPrices(); 
+}
+
+bool OrderBook::Compact() {
+	if (!orders_.empty() || level_scopes_ || IsCompact()) return false; 
+	std::unordered_map<OrderId, OrderEntry>{}.swap(orders_); 
+	std::unordered_map<OwnerId, OrderEntry*>{}.swap(owners_); 
+	batch_.reset(); 
+	if (feeds_) {
+		feeds_->touched_levels_.shrink_to_fit(); 
+		feeds_->level_deltas_.shrink_to_fit(); 
+	}
+	return true; 
+}
+
+void OrderBook::EnableDepth(std::size_t levels) {
+	auto& feeds = GetFeeds(); 
+	feeds.depth_ = std::make_unique<DepthBuffer>(levels); 
+	feeds.depth_dirty_ = true; 
+}
+
+void OrderBook::SetLevelHandler(LevelHandler on_levels) {
+	if (!on_levels && !feeds_) return; 
+	GetFeeds().on_levels_ = std::move(on_levels); 
+}
+
+void OrderBook::SetOrderEventRing(OrderEventRing* order_events, SymbolId symbol_id) {
+	if (!order_events && !feeds_) return; 
+	auto& feeds = GetFeeds(); 
+	feeds.order_events_ = order_events; 
+	feeds.order_event_symbol_ = symbol_id; 
+}
+
+const Order* OrderBook::FindOrder(OrderId order_id) const {
+	auto entry = orders_.find(order_id); 
+	return entry == orders_.end() ? nullptr : entry->second.order_.get(); 
+}
+
+std::size_t OrderBook::MassCancel(OwnerId owner_id) {
+	LevelScope scope{ *this }; 
+	auto owner = owners_.find(owner_id); 
+	if (owner == owners_.end()) return 0; 
+
+	//--- Walk the owner's intrusive list, emptied levels are collected and erased once at the end 
+	std::size_t cancelled = 0; 
+	std::vector<Price> empty_bids, empty_asks; 
+	for (auto* entry = owner->second; entry; ++cancelled) {
+		auto* next = entry->owner_next_; 
+		const auto& order = *entry->order_; 
+		auto& level = *entry->level_; 
+		TouchLevel(order.GetSide(), order.GetPrice(), level); 
+		EmitOrderEvent(OrderEventType::Deleted, order, order.GetRemainingQuantity()); 
+		level.quantity_ -= order.GetRemainingQuantity(); 
+		level.orders_.erase(entry->location_); 
+		if (level.orders_.empty()) (order.GetSide() == Side::Buy ? empty_bids : empty_asks).push_back(order.GetPrice()); 
+		orders_.erase(order.GetOrderId()); 
+		entry = next; 
+	}
+	owners_.erase(owner); 
+
+	for (auto price : empty_bids) bids_.erase(price); 
+	for (auto price : empty_asks) asks_.erase(price); 
+	UpdateBestPrices(); 
+	return cancelled; 
+}
+
+std::size_t OrderBook::MassCancel(Side side) {
+	LevelScope scope{ *this }; 
+	if (side == Side::Buy) return CancelLevels(bids_, bids_.begin(), bids_.end()); 
+	return CancelLevels(asks_, asks_.begin(), asks_.end()); 
+}
+
+std::size_t OrderBook::MassCancel(Side side, Price low, Price high) {
+	LevelScope scope{ *this }; 
+	if (low > high) return 0; 
+	if (side == Side::Buy) return CancelLevels(bids_, bids_.lower_bound(high), bids_.upper_bound(low)); 
+	return CancelLevels(asks_, asks_.lower_bound(low), asks_.upper_bound(high)); 
+}
+
+Trades OrderBook::MassQuote(OwnerId owner_id, const Quotes& quotes) {
+	LevelScope scope{ *this }; 
+	if (owner_id == Constants::NoOwner) return {}; 
+
+	const auto generation = ++quote_generations_; 
+	for (const auto& quote : quotes) {
+		if (quote.quantity_ == 0) continue; 
+
+		auto existing = orders_.find(quote.order_id_); 
+		if (existing == orders_.end()) {
+			InsertOrder(std::make_shared<Order>(OrderType::GoodTillCancel, quote.order_id_, quote.side_, 
+				quote.price_, quote.quantity_, owner_id)).quote_generation_ = generation; 
+			continue; 
+		}
+
+		//--- Ids owned by someone else, or reused on the other side, are ignored 
+		auto& entry = existing->second; 
+		if (entry.order_->GetOwnerId() != owner_id || entry.order_->GetSide() != quote.side_) continue; 
+		entry.quote_generation_ = generation; 
+		RequoteOrder(entry, quote.price_, quote.quantity_); 
+	}
+
+	//--- Anything of the owner's not restated in this quote set is cancelled 
+	auto owner = owners_.find(owner_id); 
+	for (auto* entry = owner != owners_.end() ? owner->second : nullptr; entry; ) {
+		auto* next = entry->owner_next_; 
+		if (entry->quote_generation_ != generation) CancelOrder(entry->order_->GetOrderId()); 
+		entry = next; 
+	}
+
+	UpdateBestPrices(); 
+	if (trading_phase_ == TradingPhase::Auction) return {}; 
+	return MatchOrders(); 
+}
+
+Trades OrderBook::MatchOrder(OrderModify order) {
+	LevelScope scope{ *this }; 
+	if (!orders_.contains(order.GetOrderId())) return { };
+	//--- Refused before the cancel so the resting order survives, the same rule ValidateOrder applies to adds 
+	if (order.GetQuantity() == 0) {
+		++rejected_orders_; 
+		return {}; 
+	}
+
+	const auto& existing_order = orders_.at(order.GetOrderId()).order_; 
+	const auto order_type = existing_order->GetOrderType(); 
+	const auto owner_id = existing_order->GetOwnerId(); 
+	//--- Post-only still applies to the replacement. Minimum quantity only conditions the original entry, a 
+	//--- resting remainder that had to meet it again could be cancelled by its own modify 
+	const auto post_only = existing_order->GetPostOnly(); 
+	CancelOrder(order.GetOrderId()); 
+	return AddOrder(order.ToOrderPointer(order_type, owner_id, post_only)); 
+}
+
+Trades OrderBook::Uncross() {
+	LevelScope scope{ *this }; 
+	trading_phase_ = TradingPhase::Continuous; 
+
+	//--- Volume removed by self-trade prevention can leave the book crossed, the residue uncrosses at its own price. 
+	//--- Every pass fills or cancels at least one order, so this terminates 
+	Trades trades; 
+	while (!bids_.empty() && !asks_.empty() && bids_.begin()->first >= asks_.begin()->first) UncrossOnce(trades); 
+	UpdateBestPrices(); 
+	return trades; 
+}
+
+void OrderBook::UncrossOnce(Trades& trades) {
+	//--- Candidate prices are the level prices inside the crossed range, ascending 
+	struct Candidate {
+		Price price_; 
+		std::uint64_t bid_quantity_, ask_quantity_; 
+	};
+	const Price low = asks_.begin()->first, high = bids_.begin()->first; 
+	std::vector<Candidate> candidates; 
+
+	auto ask = asks_.begin(); 
+	auto bid = std::make_reverse_iterator(bids_.upper_bound(low)); 
+	while ((ask != asks_.end() && ask->first <= high) || bid != bids_.rend()) {
+		const bool take_ask = ask != asks_.end() && ask->first <= high && (bid == bids_.rend() || ask->first <= bid->first); 
+		const bool take_bid = bid != bids_.rend() && (!take_ask || bid->first == ask->first); 
+		candidates.push_back({ take_ask ? ask->first : bid->first, 
+			take_bid ? bid->second.quantity_ : 0, take_ask ? ask->second.quantity_ : 0 }); 
+		if (take_ask) ++ask; 
+		if (take_bid) ++bid; 
+	}
+
+	//--- Prefix sums: asks accumulate upwards, bids accumulate downwards 
+	for (std::size_t i = 1; i < candidates.size(); ++i) 
+		candidates[i].ask_quantity_ += candidates[i - 1].ask_quantity_; 
+	for (std::size_t i = candidates.size() - 1; i-- > 0; ) 
+		candidates[i].bid_quantity_ += candidates[i + 1].bid_quantity_; 
+
+	//--- Maximum executable volume, then minimum imbalance, then market pressure 
+	auto Volume = [](const Candidate& c) { return std::min(c.bid_quantity_, c.ask_quantity_); }; 
+	auto Imbalance = [](const Candidate& c) { return std::max(c.bid_quantity_, c.ask_quantity_) - std::min(c.bid_quantity_, c.ask_quantity_); }; 
+
+	std::size_t first = 0, last = 0; 
+	for (std::size_t i = 1; i < candidates.size(); ++i) {
+		const auto& best = candidates[first]; 
+		if (Volume(candidates[i]) > Volume(best) || (Volume(candidates[i]) == Volume(best) && Imbalance(candidates[i]) < Imbalance(best))) 
+			first = last = i; 
+		else if (Volume(candidates[i]) == Volume(best) && Imbalance(candidates[i]) == Imbalance(best)) 
+			last = i; 
+	}
+
+	Price price; 
+	if (candidates[first].bid_quantity_ > candidates[first].ask_quantity_) price = candidates[last].price_; 
+	else if (candidates[first].bid_quantity_ < candidates[first].ask_quantity_) price = candidates[first].price_; 
+	else price = candidates[first].price_ + (candidates[last].price_ - candidates[first].price_) / 2; 
+
+	//--- Execute the whole volume in one pass, then drop the consumed levels with one range erase per side 
+	std::uint64_t remaining = Volume(candidates[first]); 
+	auto bid_level = bids_.begin(); 
+	auto ask_level = asks_.begin(); 
+	//--- Self-trade prevention can remove volume the price was computed with, so fills also stop at the price 
+	while (remaining && bid_level != bids_.end() && ask_level != asks_.end() 
+		&& bid_level->first >= price && ask_level->first <= price) {
+		TouchLevel(Side::Buy, bid_level->first, bid_level->second); 
+		TouchLevel(Side::Sell, ask_level->first, ask_level->second); 
+		auto& bids = bid_level->second.orders_; 
+		auto& asks = ask_level->second.orders_; 
+		auto bid = bids.front(); 
+		auto ask = asks.front(); 
+
+		if (IsSelfTrade(*bid, *ask)) {
+			PreventSelfTrade(bid_level->second, ask_level->second); 
+			if (bids.empty()) ++bid_level; 
+			if (asks.empty()) ++ask_level; 
+			continue; 
+		}
+
+		Quantity quantity = static_cast<Quantity>(std::min<std::uint64_t>(remaining, 
+			std::min(bid->GetRemainingQuantity(), ask->GetRemainingQuantity()))); 
+		bid->Fill(quantity); 
+		ask->Fill(quantity); 
+		bid_level->second.quantity_ -= quantity; 
+		ask_level->second.quantity_ -= quantity; 
+		remaining -= quantity; 
+		const auto sequence = ++event_sequence_; 
+		EmitOrderEvent(OrderEventType::Executed, *bid, quantity, 0, sequence); 
+		EmitOrderEvent(OrderEventType::Executed, *ask, quantity, 0, sequence); 
+
+		if (bid->IsFilled()) {
+			bids.pop_front(); 
+			EraseOrder(bid->GetOrderId()); 
+			if (bids.empty()) ++bid_level; 
+		}
+		if (ask->IsFilled()) {
+			asks.pop_front(); 
+			EraseOrder(ask->GetOrderId()); 
+			if (asks.empty()) ++ask_level; 
+		}
+
+		trades.push_back(Trade(
+			TradeInfo(bid->GetOrderId(), price, quantity),
+			TradeInfo(ask->GetOrderId(), price, quantity),
+			sequence
+		)); 
+	}
+	bids_.erase(bids_.begin(), bid_level); 
+	asks_.erase(asks_.begin(), ask_level); 
+}
+
+bool OrderBook::PublishDepth() {
+	if (!feeds_ || !feeds_->depth_ || !feeds_->depth_dirty_) return false; 
+
+	//--- A reader still on the back buffer defers this publish to the next batch 
+	auto* snapshot = feeds_->depth_->BeginWrite(); 
+	if (!snapshot) return false; 
+
+	CopyDepth(feeds_->depth_->GetDepth(), snapshot->bids_, snapshot->asks_); 
+	snapshot->event_sequence_ = event_sequence_; 
+
+	feeds_->depth_->EndWrite(); 
+	feeds_->depth_dirty_ = false; 
+	return true; 
+}
+
+void OrderBook::CopyDepth(std::size_t levels, LevelInfos& bids, LevelInfos& asks) const {
+	bids.clear(); 
+	asks.clear(); 
+	for (auto level = bids_.begin(); level != bids_.end() && bids.size() < levels; ++level) 
+		bids.push_back(LevelInfo{ level->first, level->second.quantity_ }); 
+	for (auto level = asks_.begin(); level != asks_.end() && asks.size() < levels; ++level) 
+		asks.push_back(LevelInfo{ level->first, level->second.quantity_ }); 
+}
+
+template <typename Reader>
+bool OrderBook::ReadDepth(Reader&& reader) const {
+	if (!HasDepth()) return false; 
+	feeds_->depth_->Read(std::forward<Reader>(reader)); 
+	return true; 
+}
+
+OrderBookLevelInfos OrderBook::GetOrderInfos() const {
+	LevelInfos bid_infos, ask_infos; 
+	bid_infos.reserve(bids_.size()); 
+	ask_infos.reserve(asks_.size()); 
+
+	for (const auto& [price, level] : bids_) bid_infos.push_back(LevelInfo{ price, level.quantity_ });
+	for (const auto& [price, level] : asks_) ask_infos.push_back(LevelInfo{ price, level.quantity_ });
+
+	return OrderBookLevelInfos{ bid_infos, ask_infos };
+}
+
+void OrderBook::Serialize(std::vector<char>& out) const {
+	BookSnapshotHeader header{}; 
+	header.orders_ = orders_.size(); 
+	header.arrivals_ = arrivals_; 
+	header.event_sequence_ = event_sequence_; 
+	header.self_trade_prevention_ = static_cast<std::uint8_t>(self_trade_prevention_); 
+	header.trading_phase_ = static_cast<std::uint8_t>(trading_phase_); 
+	WriteSnapshot(out, header); 
+
+	out.reserve(out.size() + orders_.size() * sizeof(SnapshotOrder)); 
+	auto WriteLevels = [&out](const auto& levels) {
+		for (const auto& [_, level] : levels) {
+			for (const auto& order : level.orders_) {
+				SnapshotOrder record{}; 
+				record.order_id_ = order->GetOrderId(); 
+				record.arrival_ = order->GetArrival(); 
+				record.price_ = order->GetPrice(); 
+				record.initial_quantity_ = order->GetInitialQuantity(); 
+				record.remaining_quantity_ = order->GetRemainingQuantity(); 
+				record.minimum_quantity_ = order->GetMinimumQuantity(); 
+				record.owner_id_ = order->GetOwnerId(); 
+				record.order_type_ = static_cast<std::uint8_t>(order->GetOrderType()); 
+				record.side_ = static_cast<std::uint8_t>(order->GetSide()); 
+				record.post_only_ = static_cast<std::uint8_t>(order->GetPostOnly()); 
+				WriteSnapshot(out, record); 
+			}
+		}
+	};
+	WriteLevels(bids_); 
+	WriteLevels(asks_); 
+}
+
+void OrderBook::CheckSnapshot(SnapshotReader& reader) {
+	const auto header = reader.Read<BookSnapshotHeader>(); 
+	if (header.self_trade_prevention_ > static_cast<std::uint8_t>(SelfTradePrevention::Decrement) 
+		|| header.trading_phase_ > static_cast<std::uint8_t>(TradingPhase::Auction)) 
+		throw std::runtime_error("Snapshot book header is invalid"); 
+	//--- The count is checked against the bytes left before anything is sized from it 
+	if (header.orders_ > reader.Remaining() / sizeof(SnapshotOrder)) throw std::runtime_error("Snapshot is truncated"); 
+
+	std::vector<OrderId> order_ids; 
+	order_ids.reserve(header.orders_); 
+	for (std::uint64_t i = 0; i < header.orders_; ++i) {
+		const auto record = reader.Read<SnapshotOrder>(); 
+		if (record.remaining_quantity_ > record.initial_quantity_ || record.remaining_quantity_ == 0) 
+			throw std::runtime_error(std::format("Snapshot order ({}) has invalid quantities", record.order_id_)); 
+		if (record.order_type_ > static_cast<std::uint8_t>(OrderType::FillAndKill) 
+			|| record.side_ > static_cast<std::uint8_t>(Side::Sell) 
+			|| record.post_only_ > static_cast<std::uint8_t>(PostOnly::Reprice)) 
+			throw std::runtime_error(std::format("Snapshot order ({}) has invalid flags", record.order_id_)); 
+		order_ids.push_back(record.order_id_); 
+	}
+	std::sort(order_ids.begin(), order_ids.end()); 
+	if (auto repeated = std::adjacent_find(order_ids.begin(), order_ids.end()); repeated != order_ids.end()) 
+		throw std::runtime_error(std::format("Snapshot repeats order ({})", *repeated)); 
+}
+
+void OrderBook::Restore(SnapshotReader& reader) {
+	//--- Validated on a copy of the cursor first, so a bad snapshot leaves the book as it was 
+	auto check = reader; 
+	CheckSnapshot(check); 
+
+	const auto header = reader.Read<BookSnapshotHeader>(); 
+	bids_.clear(); 
+	asks_.clear(); 
+	orders_.clear(); 
+	owners_.clear(); 
+	batch_.reset(); 
+	//--- A restore is not a delta, level consumers resync from GetOrderInfos() 
+	if (feeds_) feeds_->touched_levels_.clear(); 
+	orders_.reserve(header.orders_); 
+	arrivals_ = header.arrivals_; 
+	event_sequence_ = header.event_sequence_; 
+	self_trade_prevention_ = static_cast<SelfTradePrevention>(header.self_trade_prevention_); 
+	trading_phase_ = static_cast<TradingPhase>(header.trading_phase_); 
+
+	//--- Records arrive best level first and in queue order, so each level and order is appended at the end 
+	Level* level = nullptr; 
+	Side level_side = Side::Buy; 
+	Price level_price = 0; 
+	for (std::uint64_t i = 0; i < header.orders_; ++i) {
+		const auto record = reader.Read<SnapshotOrder>(); 
+		const auto side = static_cast<Side>(record.side_); 
+
+		auto order = std::make_shared<Order>(static_cast<OrderType>(record.order_type_), record.order_id_, side, 
+			record.price_, record.initial_quantity_, record.owner_id_); 
+		order->Fill(record.initial_quantity_ - record.remaining_quantity_); 
+		order->SetArrival(record.arrival_); 
+		order->SetPostOnly(static_cast<PostOnly>(record.post_only_)); 
+		order->SetMinimumQuantity(record.minimum_quantity_); 
+
+		if (!level || side != level_side || record.price_ != level_price) {
+			level = side == Side::Buy 
+				? &bids_.emplace_hint(bids_.end(), record.price_, Level{})->second 
+				: &asks_.emplace_hint(asks_.end(), record.price_, Level{})->second; 
+			level_side = side; 
+			level_price = record.price_; 
+		}
+		auto location = level->orders_.insert(level->orders_.end(), order); 
+		level->quantity_ += record.remaining_quantity_; 
+
+		auto [entry, _] = orders_.try_emplace(record.order_id_, OrderEntry{ order, location, level }); 
+		LinkOwner(entry->second); 
+	}
+	UpdateBestPrices(); 
+}
+
+
+class OrderBookManager {
+private:
+	//--- Indexed by SymbolId. Symbols never traded cost one null pointer. A book stays once created so its 
+	//--- settings, sequences and subscribers survive, and Sweep() frees the order storage of idle empty ones 
+	std::vector<std::unique_ptr<OrderBook>> books_; 
+	//--- Per-symbol L1 seqlocks handed to reader threads. They outlive the books, so a restored book 
+	//--- publishes into the same one 
+	std::vector<std::shared_ptr<Seqlock<TopOfBook>>> top_of_books_; 
+	std::size_t max_symbols_; 
+	SelfTradePrevention self_trade_prevention_; 
+	//--- Commands executed so far, equal to the journal position when every command is logged first 
+	std::uint64_t applied_commands_{ 0 }; 
+	SymbolLevelHandler on_levels_; 
+	OrderEventRing* order_events_{ nullptr }; 
+	//--- Books found empty by the last sweep, with their arrival counts at the time 
+	std::vector<std::pair<SymbolId, std::uint64_t>> idle_; 
+	static constexpr std::uint64_t SnapshotMagic = 0x54504E534B4F4F42ull; 
+
+	void InstallLevelHandler(SymbolId symbol_id); 
+
+public:
+	explicit OrderBookManager(std::size_t symbols = 0, SelfTradePrevention self_trade_prevention = SelfTradePrevention::None, 
+		std::size_t max_symbols = Constants::MaxSymbols); 
+
+	//--- Throws std::out_of_range for ids at or past the symbol limit 
+	OrderBook& GetOrderBook(SymbolId symbol_id); 
+	//--- Books may only be looked up from the thread that owns the manager 
+	OrderBook* FindOrderBook(SymbolId symbol_id) const; 
+	//--- Taken on the owning thread, the handle can then be read from any thread for as long as it is held 
+	TopOfBookHandle GetTopOfBook(SymbolId symbol_id) { return GetOrderBook(symbol_id).GetTopOfBookHandle(); }
+	Trades Execute(const Command& command); 
+	//--- Also reports whether the book took the command. Cancels and modifies of an unknown order are rejected 
+	Trades Execute(const Command& command, AckStatus& status); 
+	//--- Compacts books that stayed empty, in continuous trading and without new orders since the previous 
+	//--- sweep, returning how many were compacted. Call it periodically from the owning thread while idle 
+	std::size_t Sweep(); 
+
+	std::size_t Capacity() const { return books_.size(); }
+	std::size_t GetMaxSymbols() const { return max_symbols_; }
+	bool IsValidSymbol(SymbolId symbol_id) const { return symbol_id < max_symbols_; }
+	std::size_t ActiveBooks() const; 
+	std::uint64_t GetAppliedCommands() const { return applied_commands_; }
+	//--- Installed on every current and future book, tagged with the book's symbol 
+	void SetLevelHandler(SymbolLevelHandler on_levels); 
+	//--- One ring carries the L3 events of every current and future book, its consumer splits them by symbol 
+	void SetOrderEventRing(OrderEventRing* order_events); 
+
+	//--- Restore replaces every book with the snapshot's contents 
+	void Serialize(std::vector<char>& out) const; 
+	void Restore(std::span<const char> bytes); 
+};
+
+//--- ORDER BOOK MANAGER 
+OrderBookManager::OrderBookManager(std::size_t symbols, SelfTradePrevention self_trade_prevention, std::size_t max_symbols)
+	: books_ ( std::min(symbols, max_symbols) )
+	, max_symbols_ { max_symbols }
+	, self_trade_prevention_ { self_trade_prevention } {}
+
+OrderBook& OrderBookManager::GetOrderBook(SymbolId symbol_id) {
+	//--- Sized in size_t, so the largest SymbolId cannot wrap the table to zero 
+	if (!IsValidSymbol(symbol_id)) throw std::out_of_range(std::format("Symbol {} is past the limit of {} symbols", symbol_id, max_symbols_)); 
+	const auto size = static_cast<std::size_t>(symbol_id) + 1; 
+	if (size > books_.size()) books_.resize(size); 
+	auto& book = books_[symbol_id]; 
+	if (!book) {
+		if (size > top_of_books_.size()) top_of_books_.resize(size); 
+		auto& top_of_book = top_of_books_[symbol_id]; 
+		if (!top_of_book) top_of_book = std::make_shared<Seqlock<TopOfBook>>(); 
+		book = std::make_unique<OrderBook>(self_trade_prevention_, top_of_book); 
+		InstallLevelHandler(symbol_id); 
+		book->SetOrderEventRing(order_events_, symbol_id); 
+	}
+	return *book; 
+}
+
+void OrderBookManager::SetLevelHandler(SymbolLevelHandler on_levels) {
+	on_levels_ = std::move(on_levels); 
+	for (SymbolId symbol_id = 0; symbol_id < books_.size(); ++symbol_id) {
+		if (books_[symbol_id]) InstallLevelHandler(symbol_id); 
+	}
+}
+
+void OrderBookManager::SetOrderEventRing(OrderEventRing* order_events) {
+	order_events_ = order_events; 
+	for (SymbolId symbol_id = 0; symbol_id < books_.size(); ++symbol_id) {
+		if (books_[symbol_id]) books_[symbol_id]->SetOrderEventRing(order_events_, symbol_id); 
+	}
+}
+
+void OrderBookManager::InstallLevelHandler(SymbolId symbol_id) {
+	auto& book = *books_[symbol_id]; 
+	if (!on_levels_) {
+		book.SetLevelHandler(nullptr); 
+		return; 
+	}
+	book.SetLevelHandler([on_levels = on_levels_, symbol_id](std::span<const LevelDelta> deltas) { on_levels(symbol_id, deltas); }); 
+}
+
+OrderBook* OrderBookManager::FindOrderBook(SymbolId symbol_id) const {
+	return symbol_id < books_.size() ? books_[symbol_id].get() : nullptr; 
+}
+
+Trades OrderBookManager::Execute(const Command& command) {
+	AckStatus status; 
+	return Execute(command, status); 
+}
+
+Trades OrderBookManager::Execute(const Command& command, AckStatus& status) {
+	Trades trades; 
+	status = AckStatus::Rejected; 
+	if (!IsValidSymbol(command.symbol_id_) || !IsWellFormed(command)) {
+		++applied_commands_; 
+		return trades; 
+	}
+	auto* book = command.type_ == CommandType::Add ? &GetOrderBook(command.symbol_id_) : FindOrderBook(command.symbol_id_); 
+	if (book && (command.type_ == CommandType::Add || book->Contains(command.order_id_))) {
+		//--- Adds and modifies are refused by validation, which the book counts 
+		const auto rejected = book->GetRejectedOrders(); 
+		switch (command.type_) {
+		case CommandType::Add:
+			trades = book->AddOrder(MakeOrder(command)); 
+			break; 
+		case CommandType::Cancel:
+			book->CancelOrder(command.order_id_); 
+			break; 
+		case CommandType::Modify:
+			trades = book->MatchOrder(OrderModify(command.order_id_, command.side_, command.price_, command.quantity_)); 
+			break; 
+		}
+		if (book->GetRejectedOrders() == rejected) status = AckStatus::Accepted; 
+	}
+	++applied_commands_; 
+	return trades; 
+}
+
+std::size_t OrderBookManager::Sweep() {
+	//--- A book must sit empty for a whole sweep interval, so a symbol that keeps emptying and refilling 
+	//--- keeps its storage rather than freeing and reallocating it on every command 
+	auto Idle = [](const OrderBook& book) { return book.Size() == 0 && book.GetTradingPhase() == TradingPhase::Continuous; }; 
+	std::size_t compacted = 0; 
+	for (const auto& [symbol_id, arrivals] : idle_) {
+		auto* book = FindOrderBook(symbol_id); 
+		if (book && Idle(*book) && book->GetArrivals() == arrivals && book->Compact()) ++compacted; 
+	}
+
+	idle_.clear(); 
+	for (SymbolId symbol_id = 0; symbol_id < books_.size(); ++symbol_id) {
+		const auto* book = books_[symbol_id].get(); 
+		if (book && Idle(*book) && !book->IsCompact()) idle_.emplace_back(symbol_id, book->GetArrivals()); 
+	}
+	return compacted; 
+}
+
+std::size_t OrderBookManager::ActiveBooks() const {
+	return std::count_if(books_.begin(), books_.end(), [](const auto& book) { return book != nullptr; }); 
+}
+
+void OrderBookManager::Serialize(std::vector<char>& out) const {
+	WriteSnapshot(out, SnapshotMagic); 
+	WriteSnapshot(out, applied_commands_); 
+	WriteSnapshot(out, static_cast<std::uint64_t>(ActiveBooks())); 
+	for (SymbolId symbol_id = 0; symbol_id < books_.size(); ++symbol_id) {
+		if (!books_[symbol_id]) continue; 
+		WriteSnapshot(out, symbol_id); 
+		books_[symbol_id]->Serialize(out); 
+	}
+}
+
+void OrderBookManager::Restore(std::span<const char> bytes) {
+	SnapshotReader reader{ bytes }; 
+	if (reader.Read<std::uint64_t>() != SnapshotMagic) throw std::runtime_error("Not an order book snapshot"); 
+	const auto applied_commands = reader.Read<std::uint64_t>(); 
+	const auto books = reader.Read<std::uint64_t>(); 
+
+	//--- Every book is checked before the current ones are dropped 
+	auto check = reader; 
+	for (std::uint64_t i = 0, previous = 0; i < books; ++i) {
+		const auto symbol_id = check.Read<SymbolId>(); 
+		if (i && symbol_id <= previous) throw std::runtime_error("Snapshot symbols are out of order"); 
+		if (!IsValidSymbol(symbol_id)) throw std::runtime_error(std::format("Snapshot symbol {} is past the limit of {} symbols", symbol_id, max_symbols_)); 
+		previous = symbol_id; 
+		OrderBook::CheckSnapshot(check); 
+	}
+
+	applied_commands_ = applied_commands; 
+	books_.clear(); 
+	for (std::uint64_t i = 0; i < books; ++i) GetOrderBook(reader.Read<SymbolId>()).Restore(reader); 
+
+	//--- Symbols missing from the snapshot have no book, their readers see an empty one 
+	for (SymbolId symbol_id = 0; symbol_id < top_of_books_.size(); ++symbol_id) {
+		if (top_of_books_[symbol_id] && !FindOrderBook(symbol_id)) 
+			top_of_books_[symbol_id]->Store(TopOfBook{ std::numeric_limits<Price>::min(), 0, std::numeric_limits<Price>::max(), 0, 0 }); 
+	}
+}
+
+
+//--- Configures the calling thread: pinned to one core when core >= 0, and optionally real-time. 
+//--- Returns false if any requested setting was refused 
+bool ConfigureCurrentThread(int core, bool realtime) {
+	bool configured = true; 
+#if defined(_WIN32)
+	if (core >= 0) configured &= SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR{ 1 } << core) != 0; 
+	if (realtime) configured &= SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL) != 0; 
+#elif defined(__linux__)
+	if (core >= 0) {
+		cpu_set_t cpus; 
+		CPU_ZERO(&cpus); 
+		CPU_SET(core, &cpus); 
+		configured &= sched_setaffinity(0, sizeof(cpus), &cpus) == 0; 
+	}
+	if (realtime) {
+		sched_param parameters{}; 
+		parameters.sched_priority = sched_get_priority_max(SCHED_FIFO); 
+		configured &= sched_setscheduler(0, SCHED_FIFO, &parameters) == 0; 
+	}
+#else
+	configured = core < 0 && !realtime; 
+#endif
+	return configured; 
+}
+
+inline void CpuRelax() {
+#if defined(_WIN32)
+	YieldProcessor(); 
+#elif defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause(); 
+#elif defined(__aarch64__)
+	asm volatile("yield"); 
+#endif
+}
+
+//--- Idle polls escalate from spinning, to pause, to yield, to a timed park 
+struct BackoffPolicy {
+	std::uint32_t spins_{ 1000 }; 
+	std::uint32_t pauses_{ 1000 }; 
+	std::uint32_t yields_{ 100 }; 
+	std::chrono::microseconds park_{ 50 }; 
+};
+
+class Backoff {
+private:
+	BackoffPolicy policy_; 
+	std::uint32_t idle_{ 0 }; 
+public:
+	explicit Backoff(const BackoffPolicy& policy) : policy_{ policy } {}
+
+	void Idle(); 
+	void Reset() { idle_ = 0; }
+};
+
+//--- BACKOFF 
+void Backoff::Idle() {
+	if (idle_ < policy_.spins_) {
+		++idle_; 
+	}
+	else if (idle_ < policy_.spins_ + policy_.pauses_) {
+		++idle_; 
+		CpuRelax(); 
+	}
+	else if (idle_ < policy_.spins_ + policy_.pauses_ + policy_.yields_) {
+		++idle_; 
+		std::this_thread::yield(); 
+	}
+	else {
+		std::this_thread::sleep_for(policy_.park_); 
+	}
+}
+
+//--- Bounded multi-producer ring, producers claim slots with a CAS and publish through per-slot sequences 
+template <typename T>
+class MpscRing {
+	static_assert(std::is_trivially_copyable_v<T>, "ring records are copied by value"); 
+private:
+	struct Slot {
+		std::atomic<std::size_t> sequence_; 
+		T value_; 
+	};
+	std::unique_ptr<Slot[]> slots_; 
+	std::size_t mask_; 
+	alignas(CacheLineSize) std::atomic<std::size_t> tail_{ 0 }; 
+	alignas(CacheLineSize) std::size_t head_{ 0 }; 
+
+public:
+	explicit MpscRing(std::size_t capacity); 
+
+	bool TryPush(const T& value); 
+	template <typename Consumer>
+	std::size_t ConsumeBatch(Consumer&& consumer, std::size_t limit); 
+
+	std::size_t Capacity() const { return mask_ + 1; }
+};
+
+//--- MPSC RING 
+template <typename T>
+MpscRing<T>::MpscRing(std::size_t capacity)
+	: slots_ { std::make_unique<Slot[]>(std::bit_ceil(std::max<std::size_t>(capacity, 2))) }
+	, mask_ { std::bit_ceil(std::max<std::size_t>(capacity, 2)) - 1 } {
+	for (std::size_t i = 0; i <= mask_; ++i) slots_[i].sequence_.store(i, std::memory_order_relaxed); 
+}
+
+template <typename T>
+bool MpscRing<T>::TryPush(const T& value) {
+	auto tail = tail_.load(std::memory_order_relaxed); 
+	Slot* slot; 
+	while (true) {
+		slot = &slots_[tail & mask_]; 
+		const auto sequence = slot->sequence_.load(std::memory_order_acquire); 
+		const auto difference = static_cast<std::ptrdiff_t>(sequence - tail); 
+		if (difference == 0) {
+			if (tail_.compare_exchange_weak(tail, tail + 1, std::memory_order_relaxed)) break; 
+		}
+		else if (difference < 0) return false; 
+		else tail = tail_.load(std::memory_order_relaxed); 
+	}
+	slot->value_ = value; 
+	slot->sequence_.store(tail + 1, std::memory_order_release); 
+	return true; 
+}
+
+template <typename T>
+template <typename Consumer>
+std::size_t MpscRing<T>::ConsumeBatch(Consumer&& consumer, std::size_t limit) {
+	std::size_t count = 0; 
+	for (; count < limit; ++count, ++head_) {
+		auto& slot = slots_[head_ & mask_]; 
+		if (slot.sequence_.load(std::memory_order_acquire) != head_ + 1) break; 
+		consumer(slot.value_); 
+		slot.sequence_.store(head_ + mask_ + 1, std::memory_order_release); 
+	}
+	return count; 
+}
+
+using SpscCommandRing = SpscRing<Command>; 
+using MpscCommandRing = MpscRing<Command>; 
+
+//--- Stamps inbound commands in the order they are accepted. It must run on the single thread that 
+//--- decides input order, since replay applies commands strictly by sequence number 
+class Sequencer {
+private:
+	SequenceNumber next_; 
+public:
+	explicit Sequencer(SequenceNumber next = 1) : next_{ next } {}
+
+	SequenceNumber Stamp(Command& command) { return command.sequence_ = next_++; }
+	bool Accept(const Command& command); 
+	SequenceNumber GetNextSequence() const { return next_; }
+};
+
+//--- SEQUENCER 
+bool Sequencer::Accept(const Command& command) {
+	//--- Replicas and replay only apply the next expected sequence, gaps and duplicates are refused 
+	if (command.sequence_ != next_) return false; 
+	++next_; 
+	return true; 
+}
+
+//--- Maps a whole file. ReadWrite creates the file, reserves at least size bytes on disk and prefaults the pages 
+class MappedFile {
+private:
+	std::string path_; 
+	char* data_{ nullptr }; 
+	std::size_t size_{ 0 }; 
+#if defined(_WIN32)
+	HANDLE file_{ INVALID_HANDLE_VALUE }; 
+	HANDLE mapping_{ nullptr }; 
+#else
+	int fd_{ -1 }; 
+#endif
+
+	[[noreturn]] void Fail(const char* step) const; 
+	void Close(); 
+
+public:
+	MappedFile(std::string path, MapMode mode, std::size_t size = 0); 
+	~MappedFile() { Close(); }
+
+	MappedFile(const MappedFile&) = delete; 
+	MappedFile& operator=(const MappedFile&) = delete; 
+
+	//--- Writes the byte range back to the file and waits for the device 
+	void Flush(std::size_t offset, std::size_t length); 
+
+	//--- Hints that the mapping will be read front to back, so the kernel reads ahead aggressively 
+	void AdviseSequential() const; 
+
+	char* Data() { return data_; }
+	const char* Data() const { return data_; }
+	std::size_t Size() const { return size_; }
+	static std::size_t PageSize(); 
+};
+
+//--- MAPPED FILE 
+void MappedFile::Fail(const char* step) const {
+#if defined(_WIN32)
+	throw std::runtime_error(std::format("Cannot map {}: {} failed with error {}", path_, step, GetLastError())); 
+#else
+	throw std::runtime_error(std::format("Cannot map {}: {} failed: {}", path_, step, std::strerror(errno))); 
+#endif
+}
+
+std::size_t MappedFile::PageSize() {
+#if defined(_WIN32)
+	SYSTEM_INFO info; 
+	GetSystemInfo(&info); 
+	return info.dwAllocationGranularity; 
+#elif defined(__linux__)
+	return static_cast<std::size_t>(::sysconf(_SC_PAGESIZE)); 
+#else
+	return 4096; 
+#endif
+}
+
+MappedFile::MappedFile(std::string path, MapMode mode, std::size_t size)
+	: path_ { std::move(path) } {
+	const bool writable = mode == MapMode::ReadWrite; 
+#if defined(_WIN32)
+	file_ = CreateFileA(path_.c_str(), GENERIC_READ | (writable ? GENERIC_WRITE : 0), FILE_SHARE_READ, nullptr, 
+		writable ? OPEN_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr); 
+	if (file_ == INVALID_HANDLE_VALUE) Fail("CreateFile"); 
+	LARGE_INTEGER existing; 
+	if (!GetFileSizeEx(file_, &existing)) { Close(); Fail("GetFileSizeEx"); }
+	size_ = std::max(static_cast<std::size_t>(existing.QuadPart), writable ? size : 0); 
+	if (size_ == 0) return; 
+
+	//--- A read-write mapping larger than the file extends it 
+	const auto high = static_cast<DWORD>(static_cast<std::uint64_t>(size_) >> 32); 
+	const auto low = static_cast<DWORD>(size_ & 0xFFFFFFFFu); 
+	mapping_ = CreateFileMappingA(file_, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY, high, low, nullptr); 
+	if (!mapping_) { Close(); Fail("CreateFileMapping"); }
+	data_ = static_cast<char*>(MapViewOfFile(mapping_, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, size_)); 
+	if (!data_) { Close(); Fail("MapViewOfFile"); }
+#elif defined(__linux__)
+	fd_ = ::open(path_.c_str(), writable ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0644); 
+	if (fd_ < 0) Fail("open"); 
+	struct stat status; 
+	if (::fstat(fd_, &status) < 0) { Close(); Fail("fstat"); }
+	size_ = std::max(static_cast<std::size_t>(status.st_size), writable ? size : 0); 
+	if (size_ == 0) return; 
+
+	//--- Reserve the blocks now so a full disk fails here rather than as SIGBUS on a later store 
+	if (writable && static_cast<std::size_t>(status.st_size) < size_) {
+		if (const int error = ::posix_fallocate(fd_, 0, static_cast<off_t>(size_))) { Close(); errno = error; Fail("posix_fallocate"); }
+	}
+	void* data = ::mmap(nullptr, size_, writable ? PROT_READ | PROT_WRITE : PROT_READ, 
+		writable ? MAP_SHARED | MAP_POPULATE : MAP_SHARED, fd_, 0); 
+	if (data == MAP_FAILED) { Close(); Fail("mmap"); }
+	data_ = static_cast<char*>(data); 
+#else
+	(void)writable; 
+	throw std::runtime_error(std::format("Cannot map {}: memory-mapped files are not supported on this platform", path_)); 
+#endif
+}
+
+void MappedFile::Close() {
+#if defined(_WIN32)
+	if (data_) UnmapViewOfFile(data_); 
+	if (mapping_) CloseHandle(mapping_); 
+	if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_); 
+	mapping_ = nullptr; 
+	file_ = INVALID_HANDLE_VALUE; 
+#elif defined(__linux__)
+	if (data_) ::munmap(data_, size_); 
+	if (fd_ >= 0) ::close(fd_); 
+	fd_ = -1; 
+#endif
+	data_ = nullptr; 
+}
+
+void MappedFile::Flush(std::size_t offset, std::size_t length) {
+	if (!data_ || length == 0) return; 
+	//--- Flushes must start on a page boundary 
+	const auto page = PageSize(); 
+	const auto begin = offset / page * page; 
+	const auto end = std::min(offset + length, size_); 
+#if defined(_WIN32)
+	if (!FlushViewOfFile(data_ + begin, end - begin)) Fail("FlushViewOfFile"); 
+	if (!FlushFileBuffers(file_)) Fail("FlushFileBuffers"); 
+#elif defined(__linux__)
+	if (::msync(data_ + begin, end - begin, MS_SYNC) < 0) Fail("msync"); 
+#else
+	(void)begin; 
+	(void)end; 
+#endif
+}
+
+void MappedFile::AdviseSequential() const {
+#if defined(__linux__)
+	if (data_) ::madvise(data_, size_, MADV_SEQUENTIAL); 
+#endif
+}
+
+//--- Named POSIX shared memory. ReadWrite creates the segment, or resizes one left by a previous run, and 
+//--- prefaults it. ReadOnly attaches to an existing segment at its current size 
+class SharedMemory {
+private:
+	std::string name_; 
+	char* data_{ nullptr }; 
+	std::size_t size_{ 0 }; 
+
+	[[noreturn]] void Fail(const char* step) const; 
+
+public:
+	SharedMemory(std::string name, MapMode mode, std::size_t size = 0); 
+	~SharedMemory(); 
+
+	SharedMemory(const SharedMemory&) = delete; 
+	SharedMemory& operator=(const SharedMemory&) = delete; 
+
+	//--- Removes the name so no new process can attach. Existing mappings stay valid 
+	void Unlink(); 
+
+	const std::string& GetName() const { return name_; }
+	char* Data() { return data_; }
+	const char* Data() const { return data_; }
+	std::size_t Size() const { return size_; }
+};
+
+//--- SHARED MEMORY 
+void SharedMemory::Fail(const char* step) const {
+	throw std::runtime_error(std::format("Cannot map shared memory {}: {} failed: {}", name_, step, std::strerror(errno))); 
+}
+
+SharedMemory::SharedMemory(std::string name, MapMode mode, std::size_t size)
+	: name_ { std::move(name) } {
+#if defined(__linux__)
+	const bool writable = mode == MapMode::ReadWrite; 
+	const int fd = ::shm_open(name_.c_str(), writable ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0644); 
+	if (fd < 0) Fail("shm_open"); 
+	//--- The mapping outlives the descriptor, so it is closed on every path 
+	auto Abort = [this, fd](const char* step) {
+		const int error = errno; 
+		::close(fd); 
+		errno = error; 
+		Fail(step); 
+	};
+	struct stat status; 
+	if (::fstat(fd, &status) < 0) Abort("fstat"); 
+	size_ = writable ? size : static_cast<std::size_t>(status.st_size); 
+	if (writable && ::ftruncate(fd, static_cast<off_t>(size_)) < 0) Abort("ftruncate"); 
+	if (size_ == 0) {
+		::close(fd); 
+		throw std::runtime_error(std::format("Cannot map shared memory {}: segment is empty", name_)); 
+	}
+	void* data = ::mmap(nullptr, size_, writable ? PROT_READ | PROT_WRITE : PROT_READ, 
+		writable ? MAP_SHARED | MAP_POPULATE : MAP_SHARED, fd, 0); 
+	if (data == MAP_FAILED) Abort("mmap"); 
+	::close(fd); 
+	data_ = static_cast<char*>(data); 
+#else
+	(void)mode; 
+	(void)size; 
+	throw std::runtime_error(std::format("Cannot map shared memory {}: not supported on this platform", name_)); 
+#endif
+}
+
+SharedMemory::~SharedMemory() {
+#if defined(__linux__)
+	if (data_) ::munmap(data_, size_); 
+#endif
+}
+
+void SharedMemory::Unlink() {
+#if defined(__linux__)
+	::shm_unlink(name_.c_str()); 
+#endif
+}
+
+//--- Journal records carry a checksum so a torn or never-written slot marks the end of the log 
+struct JournalRecord {
+	Command command_; 
+	std::uint64_t checksum_; 
+};
+
+struct JournalHeader {
+	std::uint64_t magic_; 
+	std::uint32_t record_size_; 
+	std::uint32_t reserved_; 
+	std::uint64_t capacity_; 
+};
+
+//--- Pre-allocated write-ahead log of Command records. One thread appends, group commit runs on its own 
+//--- thread and advances the durable watermark, so the appender never waits on the disk 
+class Journal {
+private:
+	static constexpr std::uint64_t Magic = 0x4C4E524A4B4F4F42ull; 
+	static constexpr std::size_t RecordsOffset = CacheLineSize; 
+
+	MappedFile file_; 
+	JournalRecord* records_; 
+	std::size_t capacity_; 
+	alignas(CacheLineSize) std::atomic<std::size_t> written_{ 0 }; 
+	alignas(CacheLineSize) std::atomic<std::size_t> durable_{ 0 }; 
+	std::mutex commit_mutex_; 
+	std::atomic<bool> stopping_{ false }; 
+	std::thread committer_; 
+
+	static std::uint64_t Checksum(const Command& command); 
+
+public:
+	//--- Opens an existing journal and resumes after its last intact record, or creates one with room for capacity records 
+	Journal(const std::string& path, std::size_t capacity); 
+	~Journal(); 
+
+	Journal(const Journal&) = delete; 
+	Journal& operator=(const Journal&) = delete; 
+
+	//--- Returns false when the journal is full, the caller must not apply a command it could not log 
+	bool Append(const Command& command); 
+	std::size_t Commit(); 
+	void StartGroupCommit(std::chrono::microseconds interval); 
+	void Stop(); 
+
+	template <typename Consumer>
+	std::size_t Replay(Consumer&& consumer, std::size_t from = 0) const; 
+
+	std::size_t Size() const { return written_.load(std::memory_order_acquire); }
+	SequenceNumber GetLastSequence() const; 
+	std::size_t GetDurable() const { return durable_.load(std::memory_order_acquire); }
+	std::size_t Capacity() const { return capacity_; }
+};
+
+//--- JOURNAL 
+Journal::Journal(const std::string& path, std::size_t capacity)
+	: file_ { path, MapMode::ReadWrite, RecordsOffset + capacity * sizeof(JournalRecord) } {
+	static_assert(sizeof(JournalHeader) <= RecordsOffset); 
+	static_assert(sizeof(Command) % sizeof(std::uint64_t) == 0); 
+
+	auto& header = *reinterpret_cast<JournalHeader*>(file_.Data()); 
+	if (header.magic_ == 0) {
+		header = JournalHeader{ Magic, sizeof(JournalRecord), 0, capacity }; 
+		file_.Flush(0, sizeof(JournalHeader)); 
+	}
+	else if (header.magic_ != Magic || header.record_size_ != sizeof(JournalRecord)) 
+		throw std::runtime_error(std::format("{} is not a compatible journal", path)); 
+
+	records_ = reinterpret_cast<JournalRecord*>(file_.Data() + RecordsOffset); 
+	capacity_ = std::min<std::size_t>(header.capacity_, (file_.Size() - RecordsOffset) / sizeof(JournalRecord)); 
+
+	std::size_t written = 0; 
+	while (written < capacity_ && records_[written].checksum_ == Checksum(records_[written].command_)) ++written; 
+	written_.store(written, std::memory_order_relaxed); 
+	durable_.store(written, std::memory_order_relaxed); 
+}
+
+Journal::~Journal() {
+	Stop(); 
+}
+
+std::uint64_t Journal::Checksum(const Command& command) {
+	//--- Word-at-a-time multiply-xor, a few cycles per record. Seeded so an all-zero slot never validates 
+	std::uint64_t words[sizeof(Command) / sizeof(std::uint64_t)]; 
+	std::memcpy(words, &command, sizeof(Command)); 
+	std::uint64_t hash = Magic; 
+	for (auto word : words) hash = (hash ^ word) * 0x100000001B3ull; 
+	return hash | 1; 
+}
+
+bool Journal::Append(const Command& command) {
+	const auto written = written_.load(std::memory_order_relaxed); 
+	if (written == capacity_) return false; 
+
+	auto& record = records_[written]; 
+	std::memcpy(&record.command_, &command, sizeof(Command)); 
+	record.checksum_ = Checksum(record.command_); 
+	written_.store(written + 1, std::memory_order_release); 
+	return true; 
+}
+
+std::size_t Journal::Commit() {
+	std::lock_guard lock{ commit_mutex_ }; 
+	const auto durable = durable_.load(std::memory_order_relaxed); 
+	const auto written = written_.load(std::memory_order_acquire); 
+	if (written == durable) return durable; 
+
+	//--- One flush covers every record appended since the last commit 
+	file_.Flush(RecordsOffset + durable * sizeof(JournalRecord), (written - durable) * sizeof(JournalRecord)); 
+	durable_.store(written, std::memory_order_release); 
+	return written; 
+}
+
+void Journal::StartGroupCommit(std::chrono::microseconds interval) {
+	if (committer_.joinable()) return; 
+	stopping_.store(false, std::memory_order_relaxed); 
+	committer_ = std::thread{ [this, interval] {
+		while (!stopping_.load(std::memory_order_acquire)) {
+			Commit(); 
+			std::this_thread::sleep_for(interval); 
+		}
+	} }; 
+}
+
+void Journal::Stop() {
+	stopping_.store(true, std::memory_order_release); 
+	if (committer_.joinable()) committer_.join(); 
+	Commit(); 
+}
+
+template <typename Consumer>
+std::size_t Journal::Replay(Consumer&& consumer, std::size_t from) const {
+	const auto written = written_.load(std::memory_order_acquire); 
+	for (auto i = from; i < written; ++i) consumer(records_[i].command_); 
+	return written > from ? written - from : 0; 
+}
+
+SequenceNumber Journal::GetLastSequence() const {
+	const auto written = written_.load(std::memory_order_acquire); 
+	return written ? records_[written - 1].command_.sequence_ : 0; 
+}
+
+//--- Replays the journal past the commands the books have already applied, so it works on empty books 
+//--- and on books restored from a snapshot. Returns the sequence to resume stamping from 
+SequenceNumber RecoverFromJournal(const Journal& journal, OrderBookManager& books) {
+	journal.Replay([&books](const Command& command) { books.Execute(command); }, books.GetAppliedCommands()); 
+	return journal.GetLastSequence() + 1; 
+}
+
+void WriteSnapshotFile(const std::string& path, const OrderBookManager& books) {
+	std::vector<char> bytes; 
+	books.Serialize(bytes); 
+
+	//--- Written beside the target and renamed over it. The staging file reaches the disk before the rename and 
+	//--- the rename before returning, so after a crash the path holds either the old snapshot or the new one 
+	const auto staging = path + ".tmp"; 
+	auto Fail = [](const char* step, const std::string& name) { 
+		throw std::runtime_error(std::format("Cannot write snapshot {}: {} failed", name, step)); 
+	};
+#if defined(_WIN32)
+	const HANDLE file = CreateFileA(staging.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr); 
+	if (file == INVALID_HANDLE_VALUE) Fail("CreateFile", staging); 
+	DWORD written = 0; 
+	const bool synced = WriteFile(file, bytes.data(), static_cast<DWORD>(bytes.size()), &written, nullptr) 
+		&& written == bytes.size() && FlushFileBuffers(file); 
+	CloseHandle(file); 
+	if (!synced) Fail("WriteFile", staging); 
+	if (!MoveFileExA(staging.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) Fail("MoveFileEx", path); 
+#elif defined(__linux__)
+	const int fd = ::open(staging.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644); 
+	if (fd < 0) Fail("open", staging); 
+	for (std::size_t offset = 0; offset < bytes.size(); ) {
+		const auto written = ::write(fd, bytes.data() + offset, bytes.size() - offset); 
+		if (written < 0 && errno == EINTR) continue; 
+		if (written <= 0) { ::close(fd); Fail("write", staging); }
+		offset += static_cast<std::size_t>(written); 
+	}
+	if (::fsync(fd) != 0) { ::close(fd); Fail("fsync", staging); }
+	::close(fd); 
+	if (std::rename(staging.c_str(), path.c_str()) != 0) Fail("rename", path); 
+
+	//--- The rename lives in the directory, which needs its own sync 
+	auto directory = std::filesystem::path{ path }.parent_path(); 
+	if (directory.empty()) directory = "."; 
+	const int directory_fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC); 
+	if (directory_fd < 0) Fail("open", directory.string()); 
+	const bool synced = ::fsync(directory_fd) == 0; 
+	::close(directory_fd); 
+	if (!synced) Fail("fsync", directory.string()); 
+#else
+	{
+		std::ofstream file{ staging, std::ios::binary | std::ios::trunc }; 
+		file.write(bytes.data(), static_cast<std::streamsize>(bytes.size())); 
+		if (!file.flush()) Fail("write", staging); 
+	}
+	if (std::rename(staging.c_str(), path.c_str()) != 0) Fail("rename", path); 
+#endif
+}
+
+void ReadSnapshotFile(const std::string& path, OrderBookManager& books) {
+	const MappedFile file{ path, MapMode::ReadOnly }; 
+	books.Restore(std::span<const char>{ file.Data(), file.Size() }); 
+}
+
+//--- Periodic book checkpoints. On Linux the caller forks and the child writes its copy-on-write image of the 
+//--- books while the parent keeps matching, so the parent only pays for the fork. Elsewhere the snapshot is 
+//--- written inline. Must be called from the thread that owns the books, between commands 
+class Checkpointer {
+private:
+	std::string path_; 
+	std::chrono::steady_clock::duration interval_; 
+	std::chrono::steady_clock::time_point last_{}; 
+#if defined(__linux__)
+	pid_t child_{ -1 }; 
+#endif
+	std::atomic<std::uint64_t> taken_{ 0 }; 
+	std::atomic<std::uint64_t> failed_{ 0 }; 
+	std::atomic<std::int64_t> last_fork_ns_{ 0 }; 
+	std::atomic<std::int64_t> max_fork_ns_{ 0 }; 
+
+	bool Reap(bool block); 
+
+public:
+	Checkpointer(std::string path, std::chrono::steady_clock::duration interval); 
+	~Checkpointer() { Reap(true); }
+
+	Checkpointer(const Checkpointer&) = delete; 
+	Checkpointer& operator=(const Checkpointer&) = delete; 
+
+	//--- Takes a checkpoint once the interval has passed and the previous one has finished 
+	bool MaybeCheckpoint(const OrderBookManager& books); 
+	bool Checkpoint(const OrderBookManager& books); 
+	void Wait() { Reap(true); }
+
+	const std::string& GetPath() const { return path_; }
+	std::uint64_t GetTaken() const { return taken_.load(std::memory_order_relaxed); }
+	std::uint64_t GetFailed() const { return failed_.load(std::memory_order_relaxed); }
+	//--- Time the matching thread spent inside fork(), the only pause a checkpoint causes 
+	std::chrono::nanoseconds GetLastForkLatency() const { return std::chrono::nanoseconds{ last_fork_ns_.load(std::memory_order_relaxed) }; }
+	std::chrono::nanoseconds GetMaxForkLatency() const { return std::chrono::nanoseconds{ max_fork_ns_.load(std::memory_order_relaxed) }; }
+};
+
+//--- CHECKPOINTER 
+Checkpointer::Checkpointer(std::string path, std::chrono::steady_clock::duration interval)
+	: path_ { std::move(path) }
+	, interval_ { interval }
+	, last_ { std::chrono::steady_clock::now() } {}
+
+bool Checkpointer::Reap(bool block) {
+	//--- Returns true when no child is outstanding 
+#if defined(__linux__)
+	if (child_ < 0) return true; 
+	int status = 0; 
+	pid_t reaped; 
+	do { reaped = ::waitpid(child_, &status, block ? 0 : WNOHANG); } while (reaped < 0 && errno == EINTR); 
+	if (reaped == 0) return false; 
+	if (reaped < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) failed_.fetch_add(1, std::memory_order_relaxed); 
+	else taken_.fetch_add(1, std::memory_order_relaxed); 
+	child_ = -1; 
+#else
+	(void)block; 
+#endif
+	return true; 
+}
+
+bool Checkpointer::MaybeCheckpoint(const OrderBookManager& books) {
+	const auto now = std::chrono::steady_clock::now(); 
+	if (now - last_ < interval_) return false; 
+	if (!Reap(false)) return false; 
+	last_ = now; 
+	return Checkpoint(books); 
+}
+
+bool Checkpointer::Checkpoint(const OrderBookManager& books) {
+	if (!Reap(false)) return false; 
+#if defined(__linux__)
+	const auto start = std::chrono::steady_clock::now(); 
+	const pid_t child = ::fork(); 
+	if (child == 0) {
+		//--- Only this thread exists in the child. _exit skips destructors that would join the parent's threads 
+		int status = 0; 
+		try { WriteSnapshotFile(path_, books); }
+		catch (...) { status = 1; }
+		::_exit(status); 
+	}
+	const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(); 
+	if (child < 0) {
+		failed_.fetch_add(1, std::memory_order_relaxed); 
+		return false; 
+	}
+	child_ = child; 
+	last_fork_ns_.store(elapsed, std::memory_order_relaxed); 
+	if (elapsed > max_fork_ns_.load(std::memory_order_relaxed)) max_fork_ns_.store(elapsed, std::memory_order_relaxed); 
+	return true; 
+#else
+	try {
+		WriteSnapshotFile(path_, books); 
+		taken_.fetch_add(1, std::memory_order_relaxed); 
+		return true; 
+	}
+	catch (const std::exception&) {
+		failed_.fetch_add(1, std::memory_order_relaxed); 
+		return false; 
+	}
+#endif
+}
+
+struct ConflatedDepth {
+	SymbolId symbol_id_; 
+	SequenceNumber event_sequence_; 
+	LevelInfos bids_, asks_; 
+};
+
+//--- The snapshot is reused between calls, copy it to keep it 
+using DepthHandler = std::function<void(const ConflatedDepth&)>; 
+
+//--- Conflated top-N depth for consumers that cannot take every level delta. The level hooks mark a book 
+//--- dirty only when a change lands inside the depth it last published, and Publish() visits dirty books 
+//--- alone, so its cost follows the books that changed rather than the symbol universe. Its state is 
+//--- unsynchronised: it is attached to and polled from the thread that owns the books 
+class ConflatedPublisher {
+private:
+	struct SymbolState {
+		LevelInfos bids_, asks_; 
+		bool dirty_{ false }; 
+		bool published_{ false }; 
+	};
+	std::size_t depth_; 
+	std::chrono::steady_clock::duration interval_; 
+	std::chrono::steady_clock::time_point last_{}; 
+	DepthHandler on_depth_; 
+	std::vector<SymbolState> symbols_; 
+	std::vector<SymbolId> dirty_; 
+	ConflatedDepth scratch_{}; 
+	std::uint64_t published_{ 0 }; 
+	std::uint64_t unchanged_{ 0 }; 
+
+	SymbolState& GetState(SymbolId symbol_id); 
+	bool Emit(const OrderBookManager& books, SymbolId symbol_id, bool force); 
+
+public:
+	ConflatedPublisher(std::size_t depth, std::chrono::steady_clock::duration interval, DepthHandler on_depth); 
+
+	ConflatedPublisher(const ConflatedPublisher&) = delete; 
+	ConflatedPublisher& operator=(const ConflatedPublisher&) = delete; 
+
+	//--- Hooks the manager's level deltas. Books restored from a snapshot emit none, Republish them afterwards 
+	void Attach(OrderBookManager& books); 
+	//--- The level hook itself, for callers sharing the manager's handler with other consumers 
+	void OnLevels(SymbolId symbol_id, std::span<const LevelDelta> deltas); 
+	//--- Publishes dirty books once the interval has passed since the last publish 
+	std::size_t MaybePublish(const OrderBookManager& books); 
+	std::size_t Publish(const OrderBookManager& books); 
+	//--- Sends a symbol's current depth even if it has not changed, e.g. for a new subscriber 
+	void Republish(const OrderBookManager& books, SymbolId symbol_id) { Emit(books, symbol_id, true); }
+
+	std::size_t GetDirty() const { return dirty_.size(); }
+	std::uint64_t GetPublished() const { return published_; }
+	//--- Dirty books whose top-N came back to what was last sent, e.g. an add cancelled within one interval 
+	std::uint64_t GetUnchanged() const { return unchanged_; }
+};
+
+//--- CONFLATED PUBLISHER 
+ConflatedPublisher::ConflatedPublisher(std::size_t depth, std::chrono::steady_clock::duration interval, DepthHandler on_depth)
+	: depth_ { depth }
+	, interval_ { interval }
+	, on_depth_ { std::move(on_depth) } {
+	scratch_.bids_.reserve(depth); 
+	scratch_.asks_.reserve(depth); 
+}
+
+void ConflatedPublisher::Attach(OrderBookManager& books) {
+	books.SetLevelHandler([this](SymbolId symbol_id, std::span<const LevelDelta> deltas) { OnLevels(symbol_id, deltas); }); 
+}
+
+ConflatedPublisher::SymbolState& ConflatedPublisher::GetState(SymbolId symbol_id) {
+	const auto size = static_cast<std::size_t>(symbol_id) + 1; 
+	if (size > symbols_.size()) symbols_.resize(size); 
+	return symbols_[symbol_id]; 
+}
+
+void ConflatedPublisher::OnLevels(SymbolId symbol_id, std::span<const LevelDelta> deltas) {
+	//--- Deltas only come from books, whose ids the manager has already bounded 
+	auto& state = GetState(symbol_id); 
+	if (state.dirty_) return; 
+
+	//--- Levels past the worst one published cannot change the top-N while the published sides are full 
+	auto InView = [this, &state](const LevelDelta& delta) {
+		const auto& levels = delta.side_ == Side::Buy ? state.bids_ : state.asks_; 
+		if (!state.published_ || levels.size() < depth_) return true; 
+		return delta.side_ == Side::Buy ? delta.price_ >= levels.back().price_ : delta.price_ <= levels.back().price_; 
+	};
+	if (std::none_of(deltas.begin(), deltas.end(), InView)) return; 
+	state.dirty_ = true; 
+	dirty_.push_back(symbol_id); 
+}
+
+std::size_t ConflatedPublisher::MaybePublish(const OrderBookManager& books) {
+	if (dirty_.empty()) return 0; 
+	const auto now = std::chrono::steady_clock::now(); 
+	if (now - last_ < interval_) return 0; 
+	last_ = now; 
+	return Publish(books); 
+}
+
+std::size_t ConflatedPublisher::Publish(const OrderBookManager& books) {
+	std::size_t published = 0; 
+	for (auto symbol_id : dirty_) {
+		symbols_[symbol_id].dirty_ = false; 
+		if (Emit(books, symbol_id, false)) ++published; 
+	}
+	dirty_.clear(); 
+	return published; 
+}
+
+bool ConflatedPublisher::Emit(const OrderBookManager& books, SymbolId symbol_id, bool force) {
+	if (!books.IsValidSymbol(symbol_id)) return false; 
+	auto& state = GetState(symbol_id); 
+
+	//--- Symbols the manager has no book for publish as empty depth 
+	scratch_.symbol_id_ = symbol_id; 
+	scratch_.event_sequence_ = 0; 
+	scratch_.bids_.clear(); 
+	scratch_.asks_.clear(); 
+	if (const auto* book = books.FindOrderBook(symbol_id)) {
+		book->CopyDepth(depth_, scratch_.bids_, scratch_.asks_); 
+		scratch_.event_sequence_ = book->GetEventSequence(); 
+	}
+
+	auto Same = [](const LevelInfos& lhs, const LevelInfos& rhs) {
+		return std::equal(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(), 
+			[](const LevelInfo& a, const LevelInfo& b) { return a.price_ == b.price_ && a.quantity_ == b.quantity_; }); 
+	};
+	if (!force && state.published_ && Same(scratch_.bids_, state.bids_) && Same(scratch_.asks_, state.asks_)) {
+		++unchanged_; 
+		return false; 
+	}
+
+	state.bids_ = scratch_.bids_; 
+	state.asks_ = scratch_.asks_; 
+	state.published_ = true; 
+	++published_; 
+	if (on_depth_) on_depth_(scratch_); 
+	return true; 
+}
+
+//--- Market data bus slot: a per-slot seqlock and one encoded wire message in a single cache line. The 
+//--- sequence is 2n+1 while message n is written and 2n+2 once it is complete 
+constexpr std::size_t BusPayloadWords = 6; 
+constexpr std::size_t BusPayloadSize = BusPayloadWords * sizeof(std::uint64_t); 
+
+struct alignas(CacheLineSize) BusSlot {
+	std::atomic<std::uint64_t> sequence_; 
+	std::atomic<std::uint64_t> length_; 
+	std::atomic<std::uint64_t> words_[BusPayloadWords]; 
+};
+
+static_assert(sizeof(BusSlot) == CacheLineSize, "bus slots are one cache line"); 
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "bus atomics must be address-free to work across processes"); 
+static_assert(WireSchema::HeaderSize + std::max({ WireSchema::ExecutionSize, WireSchema::LevelUpdateSize, WireSchema::OrderEventSize }) <= BusPayloadSize, 
+	"bus slots hold one wire message"); 
+
+struct BusHeader {
+	std::atomic<std::uint64_t> magic_; 
+	std::uint64_t capacity_; 
+	std::uint32_t slot_size_; 
+	std::uint16_t schema_id_; 
+	std::uint16_t schema_version_; 
+	alignas(CacheLineSize) std::atomic<std::uint64_t> published_; 
+};
+
+constexpr std::uint64_t BusMagic = 0x5355424D4B4F4F42ull; 
+
+//--- Single-writer broadcast ring of wire messages in shared memory. The writer never waits: readers in other 
+//--- processes poll it independently and a reader the writer laps detects the overrun from the slot sequence 
+class MarketDataBus {
+private:
+	SharedMemory memory_; 
+	BusHeader* header_; 
+	BusSlot* slots_; 
+	std::uint64_t mask_; 
+	std::uint64_t next_{ 0 }; 
+
+public:
+	MarketDataBus(std::string name, std::size_t capacity); 
+	~MarketDataBus() { memory_.Unlink(); }
+
+	MarketDataBus(const MarketDataBus&) = delete; 
+	MarketDataBus& operator=(const MarketDataBus&) = delete; 
+
+	//--- Returns false if the message does not fit a slot 
+	bool Publish(std::span<const char> message); 
+	void PublishTrades(SymbolId symbol_id, const Trades& trades); 
+	void PublishLevels(SymbolId symbol_id, std::span<const LevelDelta> deltas); 
+
+	const std::string& GetName() const { return memory_.GetName(); }
+	std::uint64_t GetPublished() const { return next_; }
+	std::size_t Capacity() const { return mask_ + 1; }
+};
+
+//--- MARKET DATA BUS 
+MarketDataBus::MarketDataBus(std::string name, std::size_t capacity)
+	: memory_ { std::move(name), MapMode::ReadWrite, sizeof(BusHeader) + std::bit_ceil(std::max<std::size_t>(capacity, 2)) * sizeof(BusSlot) }
+	//--- A segment reused from a previous run is reset. The magic goes in last so readers never see it half built 
+	, header_ { new (memory_.Data()) BusHeader{} }
+	, slots_ { reinterpret_cast<BusSlot*>(memory_.Data() + sizeof(BusHeader)) }
+	, mask_ { std::bit_ceil(std::max<std::size_t>(capacity, 2)) - 1 } {
+	for (std::uint64_t i = 0; i <= mask_; ++i) new (&slots_[i]) BusSlot{}; 
+	header_->capacity_ = mask_ + 1; 
+	header_->slot_size_ = sizeof(BusSlot); 
+	header_->schema_id_ = WireSchema::Id; 
+	header_->schema_version_ = WireSchema::Version; 
+	header_->magic_.store(BusMagic, std::memory_order_release); 
+}
+
+bool MarketDataBus::Publish(std::span<const char> message) {
+	if (message.size() > BusPayloadSize) return false; 
+	std::uint64_t words[BusPayloadWords]{}; 
+	std::memcpy(words, message.data(), message.size()); 
+
+	const auto sequence = next_++; 
+	auto& slot = slots_[sequence & mask_]; 
+	slot.sequence_.store(2 * sequence + 1, std::memory_order_relaxed); 
+	std::atomic_thread_fence(std::memory_order_release); 
+	slot.length_.store(message.size(), std::memory_order_relaxed); 
+	for (std::size_t i = 0; i < BusPayloadWords; ++i) slot.words_[i].store(words[i], std::memory_order_relaxed); 
+	slot.sequence_.store(2 * sequence + 2, std::memory_order_release); 
+	header_->published_.store(next_, std::memory_order_release); 
+	return true; 
+}
+
+void MarketDataBus::PublishTrades(SymbolId symbol_id, const Trades& trades) {
+	char buffer[BusPayloadSize]; 
+	for (const auto& trade : trades) Publish({ buffer, EncodeExecution(buffer, symbol_id, trade) }); 
+}
+
+void MarketDataBus::PublishLevels(SymbolId symbol_id, std::span<const LevelDelta> deltas) {
+	char buffer[BusPayloadSize]; 
+	for (const auto& delta : deltas) {
+		Publish({ buffer, EncodeLevelUpdate(buffer, delta.event_sequence_, symbol_id, delta.side_, delta.price_, delta.quantity_, delta.orders_, delta.action_) }); 
+	}
+}
+
+enum class BusStatus {
+	Empty,
+	Message,
+	Overrun
+};
+
+struct BusMessage {
+	std::uint64_t sequence_; 
+	std::size_t length_; 
+	alignas(std::uint64_t) char data_[BusPayloadSize]; 
+
+	std::span<const char> Bytes() const { return { data_, length_ }; }
+};
+
+//--- Attaches read-only to a bus from any local process and starts at the live head 
+class MarketDataReader {
+private:
+	SharedMemory memory_; 
+	const BusHeader* header_; 
+	const BusSlot* slots_; 
+	std::uint64_t mask_; 
+	std::uint64_t next_; 
+	std::uint64_t overruns_{ 0 }; 
+	std::uint64_t lost_{ 0 }; 
+
+public:
+	explicit MarketDataReader(std::string name); 
+
+	MarketDataReader(const MarketDataReader&) = delete; 
+	MarketDataReader& operator=(const MarketDataReader&) = delete; 
+
+	//--- After an overrun the reader has skipped to the live head and should resync its books from a snapshot 
+	BusStatus Poll(BusMessage& message); 
+
+	std::uint64_t GetNextSequence() const { return next_; }
+	//--- Messages published but not yet read, a lag approaching Capacity() means an overrun is near 
+	std::uint64_t GetLag() const { return header_->published_.load(std::memory_order_acquire) - next_; }
+	std::uint64_t GetOverruns() const { return overruns_; }
+	std::uint64_t GetLost() const { return lost_; }
+	std::size_t Capacity() const { return mask_ + 1; }
+};
+
+//--- MARKET DATA READER 
+MarketDataReader::MarketDataReader(std::string name)
+	: memory_ { std::move(name), MapMode::ReadOnly }
+	, header_ { reinterpret_cast<const BusHeader*>(memory_.Data()) }
+	, slots_ { reinterpret_cast<const BusSlot*>(memory_.Data() + sizeof(BusHeader)) } {
+	if (memory_.Size() < sizeof(BusHeader) || header_->magic_.load(std::memory_order_acquire) != BusMagic) 
+		throw std::runtime_error("Not a market data bus"); 
+	if (header_->slot_size_ != sizeof(BusSlot) || header_->schema_id_ != WireSchema::Id || header_->schema_version_ != WireSchema::Version 
+		|| !std::has_single_bit(header_->capacity_) || memory_.Size() < sizeof(BusHeader) + header_->capacity_ * sizeof(BusSlot)) 
+		throw std::runtime_error("Market data bus layout does not match this build"); 
+	mask_ = header_->capacity_ - 1; 
+	next_ = header_->published_.load(std::memory_order_acquire); 
+}
+
+BusStatus MarketDataReader::Poll(BusMessage& message) {
+	const auto& slot = slots_[next_ & mask_]; 
+	const auto expected = 2 * next_ + 2; 
+	const auto before = slot.sequence_.load(std::memory_order_acquire); 
+	//--- Slot sequences only grow, so a smaller one is an older lap or message next_ still being written 
+	if (before < expected) return BusStatus::Empty; 
+
+	if (before == expected) {
+		std::uint64_t words[BusPayloadWords]; 
+		const auto length = slot.length_.load(std::memory_order_relaxed); 
+		for (std::size_t i = 0; i < BusPayloadWords; ++i) words[i] = slot.words_[i].load(std::memory_order_relaxed); 
+		std::atomic_thread_fence(std::memory_order_acquire); 
+		if (slot.sequence_.load(std::memory_order_relaxed) == expected) {
+			message.sequence_ = next_++; 
+			message.length_ = std::min<std::size_t>(length, BusPayloadSize); 
+			std::memcpy(message.data_, words, sizeof(words)); 
+			return BusStatus::Message; 
+		}
+	}
+
+	//--- The writer lapped this reader, the messages in between are gone 
+	const auto head = header_->published_.load(std::memory_order_acquire); 
+	++overruns_; 
+	lost_ += head - next_; 
+	next_ = head; 
+	return BusStatus::Overrun; 
+}
+
+//--- Called on the thread that owns the symbol, so handlers must be thread-safe. 
+//--- Trades carry their book's event sequence, the command carries the inbound sequence that caused them 
+using TradeHandler = std::function<void(const Command&, const Trades&)>; 
+
+struct RunnerOptions {
+	BackoffPolicy backoff_; 
+	int core_{ -1 }; 
+	bool realtime_{ false }; 
+	std::size_t queue_capacity_{ 1 << 16 }; 
+	std::size_t batch_size_{ 256 }; 
+	//--- Idle books are swept at most this often, and only while the runner has no commands 
+	std::chrono::steady_clock::duration sweep_interval_{ std::chrono::seconds{ 1 } }; 
+	//--- Commands are logged before they are applied, and an existing journal is replayed on start past the 
+	//--- checkpoint 
+	Journal* journal_{ nullptr }; 
+	//--- Checked after every batch, so checkpoints land between commands. It snapshots only this runner's books 
+	Checkpointer* checkpointer_{ nullptr }; 
+	//--- Attached to the runner's books on start and polled after every batch and while idle 
+	ConflatedPublisher* publisher_{ nullptr }; 
+	//--- Receives every trade and level update as it happens 
+	MarketDataBus* bus_{ nullptr }; 
+	//--- L3 events of all the runner's books, pushed from the runner thread 
+	OrderEventRing* order_events_{ nullptr }; 
+};
+
+//--- Owns a set of books and busy-polls their command ring on a dedicated thread 
+class EngineRunner {
+private:
+	OrderBookManager books_; 
+	MpscCommandRing commands_; 
+	TradeHandler on_trades_; 
+	RunnerOptions options_; 
+	std::atomic<bool> stopping_{ false }; 
+	std::atomic<bool> configured_{ false }; 
+	alignas(CacheLineSize) std::atomic<std::uint64_t> busy_cycles_{ 0 }; 
+	std::atomic<std::uint64_t> idle_cycles_{ 0 }; 
+	std::atomic<std::uint64_t> unlogged_{ 0 }; 
+	std::thread thread_; 
+
+	void Recover(); 
+	void Run(); 
+
+public:
+	//--- Recovers from the options' checkpoint and journal before the thread starts, and throws if they disagree 
+	EngineRunner(TradeHandler on_trades, const RunnerOptions& options = {}); 
+	~EngineRunner(); 
+
+	EngineRunner(const EngineRunner&) = delete; 
+	EngineRunner& operator=(const EngineRunner&) = delete; 
+
+	//--- The runner stamps sequence_ itself, whatever the submitter put there 
+	bool TrySubmit(const Command& command) { return commands_.TryPush(command); }
+	void Submit(const Command& command); 
+	void Stop(); 
+
+	//--- Poll cycles that found work versus cycles that found the ring empty 
+	std::uint64_t GetBusyCycles() const { return busy_cycles_.load(std::memory_order_relaxed); }
+	std::uint64_t GetIdleCycles() const { return idle_cycles_.load(std::memory_order_relaxed); }
+	bool IsConfigured() const { return configured_.load(std::memory_order_relaxed); }
+	//--- Commands dropped because the journal was full 
+	std::uint64_t GetUnlogged() const { return unlogged_.load(std::memory_order_relaxed); }
+};
+
+//--- ENGINE RUNNER 
+EngineRunner::EngineRunner(TradeHandler on_trades, const RunnerOptions& options)
+	: commands_ { options.queue_capacity_ }
+	, on_trades_ { std::move(on_trades) }
+	, options_ { options } {
+	Recover(); 
+	thread_ = std::thread{ [this] { Run(); } }; 
+}
+
+void EngineRunner::Recover() {
+	//--- A restarted runner rebuilds its books before taking commands: the last checkpoint first, then the 
+	//--- journal records past it. Nothing is published, consumers resynchronise from the books afterwards 
+	if (options_.checkpointer_ && std::filesystem::exists(options_.checkpointer_->GetPath())) 
+		ReadSnapshotFile(options_.checkpointer_->GetPath(), books_); 
+	if (!options_.journal_) return; 
+	if (books_.GetAppliedCommands() > options_.journal_->Size()) 
+		throw std::runtime_error(std::format("Snapshot {} is ahead of its journal", options_.checkpointer_->GetPath())); 
+	RecoverFromJournal(*options_.journal_, books_); 
+}
+
+EngineRunner::~EngineRunner() {
+	Stop(); 
+}
+
+void EngineRunner::Submit(const Command& command) {
+	//--- A full ring applies backpressure to the submitting thread 
+	while (!commands_.TryPush(command)) std::this_thread::yield(); 
+}
+
+void EngineRunner::Stop() {
+	stopping_.store(true, std::memory_order_release); 
+	if (thread_.joinable()) thread_.join(); 
+}
+
+void EngineRunner::Run() {
+	configured_.store(ConfigureCurrentThread(options_.core_, options_.realtime_), std::memory_order_relaxed); 
+	//--- Level deltas fan out to every consumer configured on this runner 
+	if (options_.publisher_ || options_.bus_) {
+		books_.SetLevelHandler([this](SymbolId symbol_id, std::span<const LevelDelta> deltas) {
+			if (options_.publisher_) options_.publisher_->OnLevels(symbol_id, deltas); 
+			if (options_.bus_) options_.bus_->PublishLevels(symbol_id, deltas); 
+		}); 
+	}
+	if (options_.order_events_) books_.SetOrderEventRing(options_.order_events_); 
+	//--- Recovered books emitted no deltas, their depth goes out once in full 
+	if (options_.publisher_) {
+		for (SymbolId symbol_id = 0; symbol_id < books_.Capacity(); ++symbol_id) {
+			if (books_.FindOrderBook(symbol_id)) options_.publisher_->Republish(books_, symbol_id); 
+		}
+	}
+
+	//--- Books are only ever touched by this thread, commands arrive through the lock-free ring 
+	std::vector<SymbolId> touched; 
+	touched.reserve(options_.batch_size_); 
+	//--- This thread is the single point that orders the runner's input, so it stamps the sequence. A journal 
+	//--- resumes numbering after its last record, and a command only takes its number once it is logged 
+	Sequencer sequencer{ options_.journal_ ? options_.journal_->GetLastSequence() + 1 : 1 }; 
+	auto Execute = [this, &touched, &sequencer](const Command& inbound) {
+		auto command = inbound; 
+		command.sequence_ = sequencer.GetNextSequence(); 
+		if (options_.journal_ && !options_.journal_->Append(command)) {
+			unlogged_.fetch_add(1, std::memory_order_relaxed); 
+			return; 
+		}
+		sequencer.Accept(command); 
+		auto trades = books_.Execute(command); 
+		if (!trades.empty() && options_.bus_) options_.bus_->PublishTrades(command.symbol_id_, trades); 
+		if (!trades.empty() && on_trades_) on_trades_(command, trades); 
+		touched.push_back(command.symbol_id_); 
+	};
+
+	Backoff backoff{ options_.backoff_ }; 
+	std::uint64_t busy = 0, idle = 0; 
+	auto last_sweep = std::chrono::steady_clock::now(); 
+	while (true) {
+		//--- Read the stop flag first so commands submitted before Stop() are always drained 
+		const bool stopping = stopping_.load(std::memory_order_acquire); 
+		if (commands_.ConsumeBatch(Execute, options_.batch_size_)) {
+			//--- Depth is published once per batch, repeated symbols return early on the dirty flag 
+			for (auto symbol_id : touched) {
+				if (auto* book = books_.FindOrderBook(symbol_id)) book->PublishDepth(); 
+			}
+			touched.clear(); 
+			if (options_.checkpointer_) options_.checkpointer_->MaybeCheckpoint(books_); 
+			if (options_.publisher_) options_.publisher_->MaybePublish(books_); 
+			busy_cycles_.store(++busy, std::memory_order_relaxed); 
+			backoff.Reset(); 
+			continue; 
+		}
+		if (stopping) {
+			if (options_.publisher_) options_.publisher_->Publish(books_); 
+			return; 
+		}
+		//--- Books left dirty inside the interval go out once it passes, even if no more commands arrive 
+		if (options_.publisher_) options_.publisher_->MaybePublish(books_); 
+		if (const auto now = std::chrono::steady_clock::now(); now - last_sweep >= options_.sweep_interval_) {
+			books_.Sweep(); 
+			last_sweep = now; 
+		}
+		idle_cycles_.store(++idle, std::memory_order_relaxed); 
+		backoff.Idle(); 
+	}
+}
+
+//--- Builds one worker's options, called for every worker before any of them starts 
+using RunnerOptionsFactory = std::function<RunnerOptions(std::size_t worker)>; 
+
+//--- Partitions symbols across runners, each pinned to its own core 
+class MatchingEngine {
+private:
+	std::vector<std::unique_ptr<EngineRunner>> runners_; 
+
+public:
+	//--- Journals, checkpointers, event rings, publishers and buses have a single writer, so no two workers may share 
+	//--- one, nor point distinct checkpointers or buses at the same file or segment. Both constructors throw 
+	//--- std::invalid_argument before starting any worker otherwise. Options given once go to every worker, so with 
+	//--- more than one they must leave these unset 
+	MatchingEngine(std::size_t workers, TradeHandler on_trades, bool pin_workers = true, const RunnerOptions& options = {}); 
+	MatchingEngine(std::size_t workers, TradeHandler on_trades, bool pin_workers, const RunnerOptionsFactory& make_options); 
+
+	//--- Sequences are stamped per runner, in the order each runner takes commands off its ring 
+	void Submit(const Command& command) { runners_[WorkerFor(command.symbol_id_)]->Submit(command); }
+	void Stop(); 
+
+	std::size_t WorkerFor(SymbolId symbol_id) const; 
+	std::size_t Workers() const { return runners_.size(); }
+	const EngineRunner& GetRunner(std::size_t worker) const { return *runners_[worker]; }
+};
+
+//--- MATCHING ENGINE 
+MatchingEngine::MatchingEngine(std::size_t workers, TradeHandler on_trades, bool pin_workers, const RunnerOptions& options)
+	: MatchingEngine(workers, std::move(on_trades), pin_workers, [&options](std::size_t) { return options; }) {}
+
+MatchingEngine::MatchingEngine(std::size_t workers, TradeHandler on_trades, bool pin_workers, const RunnerOptionsFactory& make_options) {
+	const auto cores = std::max(1u, std::thread::hardware_concurrency()); 
+	std::vector<RunnerOptions> worker_options; 
+	worker_options.reserve(workers); 
+	for (std::size_t i = 0; i < workers; ++i) {
+		worker_options.push_back(make_options(i)); 
+		if (pin_workers) worker_options.back().core_ = static_cast<int>(i % cores); 
+	}
+
+	//--- Checked before any worker starts, a shared single-user component would race between threads 
+	auto RejectShared = [&worker_options](auto member, const char* name) {
+		for (std::size_t i = 0; i < worker_options.size(); ++i) {
+			for (std::size_t j = 0; j < i; ++j) {
+				if (worker_options[i].*member && worker_options[i].*member == worker_options[j].*member) 
+					throw std::invalid_argument(std::format("Workers {} and {} share one {}, each worker needs its own", j, i, name)); 
+			}
+		}
+	};
+	RejectShared(&RunnerOptions::journal_, "journal"); 
+	RejectShared(&RunnerOptions::checkpointer_, "checkpointer"); 
+	RejectShared(&RunnerOptions::order_events_, "order event ring"); 
+	RejectShared(&RunnerOptions::publisher_, "conflated publisher"); 
+	RejectShared(&RunnerOptions::bus_, "market data bus"); 
+
+	//--- Distinct objects can still write to one file or segment: a checkpoint holds only its worker's shard 
+	//--- and a bus segment takes a single writer 
+	auto RejectSameTarget = [&worker_options](auto member, auto target, const char* name) {
+		for (std::size_t i = 0; i < worker_options.size(); ++i) {
+			for (std::size_t j = 0; j < i; ++j) {
+				const auto* first = worker_options[j].*member; 
+				const auto* second = worker_options[i].*member; 
+				if (first && second && (first->*target)() == (second->*target)()) 
+					throw std::invalid_argument(std::format("Workers {} and {} use the same {} {}", j, i, name, (first->*target)())); 
+			}
+		}
+	};
+	RejectSameTarget(&RunnerOptions::checkpointer_, &Checkpointer::GetPath, "checkpoint path"); 
+	RejectSameTarget(&RunnerOptions::bus_, &MarketDataBus::GetName, "bus segment"); 
+
+	runners_.reserve(workers); 
+	for (const auto& options : worker_options) runners_.push_back(std::make_unique<EngineRunner>(on_trades, options)); 
+}
+
+std::size_t MatchingEngine::WorkerFor(SymbolId symbol_id) const {
+	//--- Multiplicative hash so neighbouring ids do not cluster on one worker 
+	return (static_cast<std::uint64_t>(symbol_id) * 0x9E3779B97F4A7C15ull >> 32) % runners_.size(); 
+}
+
+void MatchingEngine::Stop() {
+	for (auto& runner : runners_) runner->Stop(); 
+}
+
+//--- Per-thread deques, owners pop newest work from the back and idle threads steal oldest from the front 
+class WorkStealingPool {
+private:
+	struct Queue {
+		std::mutex mutex_; 
+		std::deque<std::function<void()>> tasks_; 
+	};
+	std::vector<std::unique_ptr<Queue>> queues_; 
+	std::vector<std::thread> threads_; 
+	std::atomic<std::size_t> pending_{ 0 }; 
+	std::atomic<std::size_t> next_queue_{ 0 }; 
+	std::atomic<bool> stopping_{ false }; 
+
+	bool TryRun(std::size_t index); 
+
+public:
+	explicit WorkStealingPool(std::size_t threads); 
+	~WorkStealingPool(); 
+
+	WorkStealingPool(const WorkStealingPool&) = delete; 
+	WorkStealingPool& operator=(const WorkStealingPool&) = delete; 
+
+	void Submit(std::function<void()> task); 
+	void Wait(); 
+};
+
+//--- WORK STEALING POOL 
+WorkStealingPool::WorkStealingPool(std::size_t threads) {
+	threads = std::max<std::size_t>(threads, 1); 
+	for (std::size_t i = 0; i < threads; ++i) queues_.push_back(std::make_unique<Queue>()); 
+	for (std::size_t i = 0; i < threads; ++i) {
+		threads_.emplace_back([this, i] {
+			Backoff backoff{ BackoffPolicy{ 0, 64, 16, std::chrono::microseconds{ 200 } } }; 
+			while (!stopping_.load(std::memory_order_acquire)) {
+				if (TryRun(i)) backoff.Reset(); 
+				else backoff.Idle(); 
+			}
+		}); 
+	}
+}
+
+WorkStealingPool::~WorkStealingPool() {
+	Wait(); 
+	stopping_.store(true, std::memory_order_release); 
+	for (auto& thread : threads_) thread.join(); 
+}
+
+bool WorkStealingPool::TryRun(std::size_t index) {
+	std::function<void()> task; 
+	for (std::size_t i = 0; i < queues_.size() && !task; ++i) {
+		auto& queue = *queues_[(index + i) % queues_.size()]; 
+		std::lock_guard lock{ queue.mutex_ }; 
+		if (queue.tasks_.empty()) continue; 
+		if (i == 0) {
+			task = std::move(queue.tasks_.back()); 
+			queue.tasks_.pop_back(); 
+		}
+		else {
+			task = std::move(queue.tasks_.front()); 
+			queue.tasks_.pop_front(); 
+		}
+	}
+	if (!task) return false; 
+	task(); 
+	pending_.fetch_sub(1, std::memory_order_acq_rel); 
+	return true; 
+}
+
+void WorkStealingPool::Submit(std::function<void()> task) {
+	pending_.fetch_add(1, std::memory_order_acq_rel); 
+	auto& queue = *queues_[next_queue_.fetch_add(1, std::memory_order_relaxed) % queues_.size()]; 
+	std::lock_guard lock{ queue.mutex_ }; 
+	queue.tasks_.push_back(std::move(task)); 
+}
+
+void WorkStealingPool::Wait() {
+	Backoff backoff{ BackoffPolicy{ 0, 0, 64, std::chrono::microseconds{ 500 } } }; 
+	while (pending_.load(std::memory_order_acquire)) backoff.Idle(); 
+}
+
+//--- Reads a file of raw Command records as written by the engine 
+std::vector<Command> ReadCommandFile(const std::string& path) {
+	std::ifstream file{ path, std::ios::binary | std::ios::ate }; 
+	if (!file) throw std::runtime_error(std::format("Cannot open command file {}", path)); 
+
+	std::vector<Command> commands(static_cast<std::size_t>(file.tellg()) / sizeof(Command)); 
+	file.seekg(0); 
+	file.read(reinterpret_cast<char*>(commands.data()), commands.size() * sizeof(Command)); 
+	return commands; 
+}
+
+struct BacktestJob {
+	SymbolId symbol_id_; 
+	std::uint32_t day_; 
+	std::string path_; 
+};
+
+struct BacktestResult {
+	SymbolId symbol_id_{ 0 }; 
+	std::uint32_t day_{ 0 }; 
+	std::uint64_t commands_{ 0 }; 
+	std::uint64_t trades_{ 0 }; 
+	std::uint64_t traded_quantity_{ 0 }; 
+	std::size_t resting_orders_{ 0 }; 
+	std::size_t max_bid_levels_{ 0 }, max_ask_levels_{ 0 }; 
+	double average_spread_{ 0 }; 
+	Trades trade_log_; 
+};
+
+using BacktestResults = std::vector<BacktestResult>; 
+using CommandLoader = std::function<std::vector<Command>(const BacktestJob&)>; 
+
+class BacktestRunner {
+private:
+	std::size_t threads_; 
+	CommandLoader loader_; 
+	bool keep_trades_; 
+	std::size_t batch_size_; 
+
+	BacktestResult RunJob(const BacktestJob& job) const; 
+
+public:
+	BacktestRunner(std::size_t threads, CommandLoader loader, bool keep_trades = false, std::size_t batch_size = 1024); 
+	explicit BacktestRunner(std::size_t threads); 
+
+	//--- Results come back ordered by (day, symbol) whatever order the jobs finished in 
+	BacktestResults Run(const std::vector<BacktestJob>& jobs) const; 
+};
+
+//--- BACKTEST RUNNER 
+BacktestRunner::BacktestRunner(std::size_t threads, CommandLoader loader, bool keep_trades, std::size_t batch_size)
+	: threads_ { threads }
+	, loader_ { std::move(loader) }
+	, keep_trades_ { keep_trades }
+	, batch_size_ { std::max<std::size_t>(batch_size, 1) } {}
+
+BacktestRunner::BacktestRunner(std::size_t threads)
+	: BacktestRunner(threads, [](const BacktestJob& job) { return ReadCommandFile(job.path_); }) {}
+
+BacktestResult BacktestRunner::RunJob(const BacktestJob& job) const {
+	const auto commands = loader_(job); 
+	OrderBook book; 
+	BacktestResult result; 
+	result.symbol_id_ = job.symbol_id_; 
+	result.day_ = job.day_; 
+	result.commands_ = commands.size(); 
+
+	double spread_sum = 0; 
+	std::uint64_t spread_samples = 0; 
+	for (std::size_t i = 0; i < commands.size(); i += batch_size_) {
+		const auto trades = book.Apply(std::span<const Command>(commands).subspan(i, std::min(batch_size_, commands.size() - i))); 
+		result.trades_ += trades.size(); 
+		for (const auto& trade : trades) result.traded_quantity_ += trade.GetBidTrade().quanity_; 
+		if (keep_trades_) result.trade_log_.insert(result.trade_log_.end(), trades.begin(), trades.end()); 
+
+		//--- Depth statistics are sampled at batch boundaries 
+		result.max_bid_levels_ = std::max(result.max_bid_levels_, book.BidLevels()); 
+		result.max_ask_levels_ = std::max(result.max_ask_levels_, book.AskLevels()); 
+		const auto top = book.ReadTopOfBook(); 
+		if (top.bid_quantity_ && top.ask_quantity_) {
+			spread_sum += static_cast<double>(top.ask_price_) - top.bid_price_; 
+			++spread_samples; 
+		}
+	}
+	result.resting_orders_ = book.Size(); 
+	result.average_spread_ = spread_samples ? spread_sum / spread_samples : 0; 
+	return result; 
+}
+
+BacktestResults BacktestRunner::Run(const std::vector<BacktestJob>& jobs) const {
+	//--- Each job writes only its own slot, so the merge is a sort rather than a race 
+	BacktestResults results(jobs.size()); 
+	std::vector<std::exception_ptr> errors(jobs.size()); 
+	{
+		WorkStealingPool pool{ threads_ }; 
+		for (std::size_t i = 0; i < jobs.size(); ++i) {
+			pool.Submit([this, &jobs, &results, &errors, i] {
+				try {
+					results[i] = RunJob(jobs[i]); 
+				}
+				catch (...) {
+					errors[i] = std::current_exception(); 
+				}
+			}); 
+		}
+		pool.Wait(); 
+	}
+	for (const auto& error : errors) {
+		if (error) std::rethrow_exception(error); 
+	}
+
+	std::stable_sort(results.begin(), results.end(), [](const BacktestResult& left, const BacktestResult& right) {
+		return std::tie(left.day_, left.symbol_id_) < std::tie(right.day_, right.symbol_id_); 
+	}); 
+	return results; 
+}
+
+
+//--- ITCH 5.0 fields are big-endian. The byte loop compiles to a single load and bswap 
+template <typename T>
+T LoadBigEndian(const char* bytes) {
+	T value = 0; 
+	for (std::size_t i = 0; i < sizeof(T); ++i) value = static_cast<T>(value << 8) | static_cast<unsigned char>(bytes[i]); 
+	return value; 
+}
+
+struct ItchStats {
+	std::uint64_t messages_{ 0 }; 
+	std::uint64_t adds_{ 0 }; 
+	std::uint64_t executions_{ 0 }; 
+	std::uint64_t cancels_{ 0 }; 
+	std::uint64_t deletes_{ 0 }; 
+	std::uint64_t replaces_{ 0 }; 
+	//--- Message types that do not change the order book 
+	std::uint64_t ignored_{ 0 }; 
+	std::uint64_t bytes_{ 0 }; 
+	std::chrono::nanoseconds elapsed_{ 0 }; 
+
+	double MessagesPerSecond() const { return elapsed_.count() ? messages_ * 1e9 / elapsed_.count() : 0.0; }
+};
+
+//--- Replays a NASDAQ TotalView-ITCH 5.0 stream of length-prefixed messages into per-stock books, 
+//--- keyed by stock locate. Fields are read straight out of the input buffer 
+class ItchReplay {
+private:
+	OrderBookManager& books_; 
+	ItchStats stats_; 
+
+	void Handle(const char* message, std::size_t length); 
+
+public:
+	explicit ItchReplay(OrderBookManager& books) : books_{ books } {}
+
+	//--- Returns the bytes consumed, a trailing partial message is left for the next call 
+	std::size_t Replay(std::span<const char> bytes); 
+	const ItchStats& GetStats() const { return stats_; }
+};
+
+//--- ITCH REPLAY 
+std::size_t ItchReplay::Replay(std::span<const char> bytes) {
+	const auto start = std::chrono::steady_clock::now(); 
+	std::size_t offset = 0; 
+	while (bytes.size() - offset >= 2) {
+		const auto length = LoadBigEndian<std::uint16_t>(bytes.data() + offset); 
+		if (bytes.size() - offset - 2 < length) break; 
+		Handle(bytes.data() + offset + 2, length); 
+		offset += 2 + length; 
+	}
+	stats_.bytes_ += offset; 
+	stats_.elapsed_ += std::chrono::steady_clock::now() - start; 
+	return offset; 
+}
+
+void ItchReplay::Handle(const char* message, std::size_t length) {
+	++stats_.messages_; 
+	if (length == 0) return; 
+
+	//--- Common header: type, stock locate, tracking number, 6-byte timestamp. Order reference follows at 11 
+	const auto locate = [message] { return static_cast<SymbolId>(LoadBigEndian<std::uint16_t>(message + 1)); }; 
+	const auto reference = [message](std::size_t at) { return LoadBigEndian<OrderId>(message + at); }; 
+	switch (message[0]) {
+	case 'A': 
+	case 'F': {
+		if (length < 36) break; 
+		const auto side = message[19] == 'B' ? Side::Buy : Side::Sell; 
+		books_.GetOrderBook(locate()).AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, reference(11), side, 
+			static_cast<Price>(LoadBigEndian<std::uint32_t>(message + 32)), LoadBigEndian<Quantity>(message + 20))); 
+		++stats_.adds_; 
+		return; 
+	}
+	case 'E': 
+	case 'C': 
+		if (length < 31) break; 
+		if (auto* book = books_.FindOrderBook(locate())) book->ReduceOrder(reference(11), LoadBigEndian<Quantity>(message + 19)); 
+		++stats_.executions_; 
+		return; 
+	case 'X': 
+		if (length < 23) break; 
+		if (auto* book = books_.FindOrderBook(locate())) book->ReduceOrder(reference(11), LoadBigEndian<Quantity>(message + 19)); 
+		++stats_.cancels_; 
+		return; 
+	case 'D': 
+		if (length < 19) break; 
+		if (auto* book = books_.FindOrderBook(locate())) book->CancelOrder(reference(11)); 
+		++stats_.deletes_; 
+		return; 
+	case 'U': {
+		if (length < 35) break; 
+		//--- A replace loses priority: the original is deleted and the new reference added on the same side 
+		auto* book = books_.FindOrderBook(locate()); 
+		const auto* original = book ? book->FindOrder(reference(11)) : nullptr; 
+		if (original) {
+			const auto side = original->GetSide(); 
+			book->CancelOrder(reference(11)); 
+			book->AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, reference(19), side, 
+				static_cast<Price>(LoadBigEndian<std::uint32_t>(message + 31)), LoadBigEndian<Quantity>(message + 27))); 
+		}
+		++stats_.replaces_; 
+		return; 
+	}
+	}
+	++stats_.ignored_; 
+}
+
+ItchStats ReplayItchFile(const std::string& path, OrderBookManager& books) {
+	const MappedFile file{ path, MapMode::ReadOnly }; 
+	file.AdviseSequential(); 
+	ItchReplay replay{ books }; 
+	replay.Replay(std::span<const char>{ file.Data(), file.Size() }); 
+	return replay.GetStats(); 
+}
+
+//--- Parses one "timestamp,type,id,side,price,quantity" line. Type is A(dd), C(ancel) or M(odify), side is B or S 
+//--- and prices are integer ticks. Cancels may stop after the id 
+Command ParseOrderFlowLine(const char* first, const char* last, SymbolId symbol_id, std::size_t offset) {
+	auto Fail = [offset]() { throw std::runtime_error(std::format("Malformed order flow line at byte {}", offset)); }; 
+	auto Next = [&first, last]() {
+		const char* comma = std::find(first, last, ','); 
+		std::string_view field{ first, static_cast<std::size_t>(comma - first) }; 
+		first = comma == last ? last : comma + 1; 
+		return field; 
+	};
+	auto Parse = [&Fail](std::string_view field, auto& value) {
+		const auto [end, error] = std::from_chars(field.data(), field.data() + field.size(), value); 
+		if (error != std::errc{} || end != field.data() + field.size()) Fail(); 
+	};
+
+	Command command{}; 
+	command.symbol_id_ = symbol_id; 
+	command.order_type_ = OrderType::GoodTillCancel; 
+	std::uint64_t timestamp; 
+	Parse(Next(), timestamp); 
+	const auto type = Next(); 
+	switch (type.empty() ? '\0' : type[0]) {
+	case 'A': case 'a': command.type_ = CommandType::Add; break; 
+	case 'C': case 'c': command.type_ = CommandType::Cancel; break; 
+	case 'M': case 'm': command.type_ = CommandType::Modify; break; 
+	default: Fail(); 
+	}
+	Parse(Next(), command.order_id_); 
+	if (command.type_ == CommandType::Cancel) return command; 
+
+	const auto side = Next(); 
+	switch (side.empty() ? '\0' : side[0]) {
+	case 'B': case 'b': command.side_ = Side::Buy; break; 
+	case 'S': case 's': command.side_ = Side::Sell; break; 
+	default: Fail(); 
+	}
+	Parse(Next(), command.price_); 
+	Parse(Next(), command.quantity_); 
+	return command; 
+}
+
+//--- Parses the whole lines of one chunk. Lines not starting with a digit are headers or comments 
+void ParseOrderFlowChunk(std::span<const char> text, std::size_t offset, SymbolId symbol_id, std::vector<Command>& commands) {
+	const char* cursor = text.data(); 
+	const char* end = cursor + text.size(); 
+	while (cursor < end) {
+		const auto* newline = static_cast<const char*>(std::memchr(cursor, '\n', static_cast<std::size_t>(end - cursor))); 
+		const char* line_end = newline ? newline : end; 
+		const char* last = line_end > cursor && line_end[-1] == '\r' ? line_end - 1 : line_end; 
+		if (cursor < last && *cursor >= '0' && *cursor <= '9') 
+			commands.push_back(ParseOrderFlowLine(cursor, last, symbol_id, offset + static_cast<std::size_t>(cursor - text.data()))); 
+		cursor = line_end + 1; 
+	}
+}
+
+//--- Splits the text at line boundaries and parses the chunks in parallel. Commands keep file order and 
+//--- are stamped 1..n, ready for OrderBook::Apply or a BacktestRunner loader 
+std::vector<Command> ParseOrderFlow(std::span<const char> text, SymbolId symbol_id = 0, 
+	std::size_t threads = std::thread::hardware_concurrency()) {
+	constexpr std::size_t MinimumChunk = 1 << 20; 
+	threads = std::max<std::size_t>(threads, 1); 
+	const auto chunks = std::clamp<std::size_t>(text.size() / MinimumChunk, 1, threads * 4); 
+
+	std::vector<std::size_t> bounds{ 0 }; 
+	for (std::size_t i = 1; i < chunks; ++i) {
+		const auto target = std::max(text.size() / chunks * i, bounds.back()); 
+		const auto* newline = static_cast<const char*>(std::memchr(text.data() + target, '\n', text.size() - target)); 
+		if (!newline) break; 
+		bounds.push_back(static_cast<std::size_t>(newline - text.data()) + 1); 
+	}
+	bounds.push_back(text.size()); 
+
+	std::vector<std::vector<Command>> parsed(bounds.size() - 1); 
+	std::vector<std::exception_ptr> errors(parsed.size()); 
+	auto ParseChunk = [&](std::size_t i) {
+		try {
+			const auto chunk = text.subspan(bounds[i], bounds[i + 1] - bounds[i]); 
+			//--- Typical lines are 25-40 bytes 
+			parsed[i].reserve(chunk.size() / 24); 
+			ParseOrderFlowChunk(chunk, bounds[i], symbol_id, parsed[i]); 
+		}
+		catch (...) {
+			errors[i] = std::current_exception(); 
+		}
+	};
+	if (parsed.size() == 1 || threads == 1) {
+		for (std::size_t i = 0; i < parsed.size(); ++i) ParseChunk(i); 
+	}
+	else {
+		WorkStealingPool pool{ std::min(threads, parsed.size()) }; 
+		for (std::size_t i = 0; i < parsed.size(); ++i) pool.Submit([&ParseChunk, i] { ParseChunk(i); }); 
+		pool.Wait(); 
+	}
+	for (const auto& error : errors) {
+		if (error) std::rethrow_exception(error); 
+	}
+
+	std::vector<Command> commands; 
+	std::size_t total = 0; 
+	for (const auto& chunk : parsed) total += chunk.size(); 
+	commands.reserve(total); 
+	for (const auto& chunk : parsed) commands.insert(commands.end(), chunk.begin(), chunk.end()); 
+
+	Sequencer sequencer; 
+	for (auto& command : commands) sequencer.Stamp(command); 
+	return commands; 
+}
+
+std::vector<Command> ReadOrderFlowFile(const std::string& path, SymbolId symbol_id = 0, 
+	std::size_t threads = std::thread::hardware_concurrency()) {
+	const MappedFile file{ path, MapMode::ReadOnly }; 
+	file.AdviseSequential(); 
+	return ParseOrderFlow(std::span<const char>{ file.Data(), file.Size() }, symbol_id, threads); 
+}
+
+#if defined(__linux__)
+//--- Fire-and-forget coroutine, the frame frees itself when the body finishes 
+struct DetachedTask {
+	struct promise_type {
+		DetachedTask get_return_object() { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+//--- Local gateway: clients write raw Command records over a Unix domain socket and read back wire messages: 
+//--- an OrderAck per command, carrying its sequence, and an Executed OrderEvent per fill of one of their 
+//--- resting or incoming orders. Matching runs on the gateway thread, so Run() owns the books it is given 
+class OrderGateway {
+private:
+	struct Connection {
+		std::uint64_t id_{ 0 }; 
+		int fd_{ -1 }; 
+		std::coroutine_handle<> reader_; 
+		std::vector<char> input_; 
+		std::size_t input_size_{ 0 }; 
+		std::vector<char> output_; 
+		std::size_t output_offset_{ 0 }; 
+		bool dirty_{ false }; 
+	};
+	struct Readable {
+		Connection& connection_; 
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> handle) noexcept { connection_.reader_ = handle; }
+		void await_resume() const noexcept {}
+	};
+
+	std::string path_; 
+	OrderBookManager& books_; 
+	Journal* journal_; 
+	Sequencer sequencer_; 
+	int epoll_fd_{ -1 }; 
+	Connection listener_; 
+	Connection wakeup_; 
+	std::atomic<bool> stopping_{ false }; 
+	std::uint64_t next_connection_id_{ 1 }; 
+	std::unordered_map<std::uint64_t, std::unique_ptr<Connection>> connections_; 
+	//--- Order ids are only unique within a symbol 
+	using RouteKey = std::pair<SymbolId, OrderId>; 
+	struct RouteHash {
+		std::size_t operator()(const RouteKey& key) const { return std::hash<OrderId>{}(key.second * 0x9E3779B97F4A7C15ull ^ key.first); }
+	};
+	std::unordered_map<RouteKey, std::uint64_t, RouteHash> order_connections_; 
+	std::vector<Connection*> dirty_; 
+	std::vector<std::uint64_t> closed_; 
+
+	DetachedTask Accept(); 
+	DetachedTask Session(Connection& connection); 
+	void Process(Connection& connection); 
+	void Report(Connection& connection, std::span<const char> message); 
+	void Acknowledge(Connection& connection, const Command& command, AckStatus status); 
+	void ReportFill(const TradeInfo& fill, Side side, SymbolId symbol_id, SequenceNumber sequence, Quantity remaining); 
+	void Flush(Connection& connection); 
+	void Close(Connection& connection); 
+	void Watch(Connection& connection, std::uint32_t events); 
+
+public:
+	OrderGateway(std::string path, OrderBookManager& books, Journal* journal = nullptr); 
+	~OrderGateway(); 
+
+	OrderGateway(const OrderGateway&) = delete; 
+	OrderGateway& operator=(const OrderGateway&) = delete; 
+
+	void Run(); 
+	void Stop(); 
+};
+
+//--- ORDER GATEWAY 
+OrderGateway::OrderGateway(std::string path, OrderBookManager& books, Journal* journal)
+	: path_ { std::move(path) }
+	, books_ { books }
+	, journal_ { journal }
+	, sequencer_ { journal ? journal->GetLastSequence() + 1 : 1 } {
+	auto Fail = [this](const char* step) {
+		throw std::runtime_error(std::format("Gateway {} failed on {}: {}", step, path_, std::strerror(errno))); 
+	};
+
+	sockaddr_un address{}; 
+	address.sun_family = AF_UNIX; 
+	if (path_.size() >= sizeof(address.sun_path)) throw std::runtime_error(std::format("Gateway path too long: {}", path_)); 
+	std::memcpy(address.sun_path, path_.c_str(), path_.size() + 1); 
+
+	epoll_fd_ = ::epoll_create1(EPOLL_CLOEXEC); 
+	if (epoll_fd_ < 0) Fail("epoll_create1"); 
+	listener_.fd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0); 
+	if (listener_.fd_ < 0) Fail("socket"); 
+	::unlink(path_.c_str()); 
+	if (::bind(listener_.fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) Fail("bind"); 
+	if (::listen(listener_.fd_, SOMAXCONN) < 0) Fail("listen"); 
+	wakeup_.fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC); 
+	if (wakeup_.fd_ < 0) Fail("eventfd"); 
+
+	Watch(listener_, EPOLLIN | EPOLLET); 
+	Watch(wakeup_, EPOLLIN | EPOLLET); 
+}
+
+OrderGateway::~OrderGateway() {
+	//--- Suspended sessions are destroyed before the connections their frames refer to 
+	for (auto& [_, connection] : connections_) {
+		if (connection->reader_) connection->reader_.destroy(); 
+		if (connection->fd_ >= 0) ::close(connection->fd_); 
+	}
+	if (listener_.reader_) listener_.reader_.destroy(); 
+	for (int fd : { listener_.fd_, wakeup_.fd_, epoll_fd_ }) {
+		if (fd >= 0) ::close(fd); 
+	}
+	::unlink(path_.c_str()); 
+}
+
+void OrderGateway::Watch(Connection& connection, std::uint32_t events) {
+	epoll_event event{}; 
+	event.events = events; 
+	event.data.ptr = &connection; 
+	if (::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, connection.fd_, &event) < 0) 
+		throw std::runtime_error(std::format("Gateway epoll_ctl failed: {}", std::strerror(errno))); 
+}
+
+void OrderGateway::Stop() {
+	stopping_.store(true, std::memory_order_release); 
+	const std::uint64_t signal = 1; 
+	[[maybe_unused]] auto written = ::write(wakeup_.fd_, &signal, sizeof(signal)); 
+}
+
+void OrderGateway::Run() {
+	Accept(); 
+
+	epoll_event events[64]; 
+	while (!stopping_.load(std::memory_order_acquire)) {
+		const int ready = ::epoll_wait(epoll_fd_, events, 64, -1); 
+		if (ready < 0) {
+			if (errno == EINTR) continue; 
+			throw std::runtime_error(std::format("Gateway epoll_wait failed: {}", std::strerror(errno))); 
+		}
+
+		for (int i = 0; i < ready; ++i) {
+			auto& connection = *static_cast<Connection*>(events[i].data.ptr); 
+			if (&connection == &wakeup_) continue; 
+			if ((events[i].events & EPOLLOUT) && connection.output_offset_ < connection.output_.size() && !connection.dirty_) {
+				connection.dirty_ = true; 
+				dirty_.push_back(&connection); 
+			}
+			if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+				if (auto reader = std::exchange(connection.reader_, nullptr)) reader.resume(); 
+			}
+		}
+
+		//--- Reports produced by the whole wakeup leave in one write per connection 
+		for (auto* connection : dirty_) Flush(*connection); 
+		dirty_.clear(); 
+		for (auto id : closed_) connections_.erase(id); 
+		closed_.clear(); 
+	}
+}
+
+DetachedTask OrderGateway::Accept() {
+	while (!stopping_.load(std::memory_order_acquire)) {
+		const int fd = ::accept4(listener_.fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC); 
+		if (fd < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) co_await Readable{ listener_ }; 
+			else if (errno != EINTR && errno != ECONNABORTED) co_return; 
+			continue; 
+		}
+
+		auto connection = std::make_unique<Connection>(); 
+		connection->id_ = next_connection_id_++; 
+		connection->fd_ = fd; 
+		connection->input_.resize(64 * 1024); 
+		auto& session = *connection; 
+		connections_.emplace(session.id_, std::move(connection)); 
+		Watch(session, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET); 
+		Session(session); 
+	}
+}
+
+DetachedTask OrderGateway::Session(Connection& connection) {
+	//--- Edge-triggered: read until the socket is drained before waiting again 
+	while (true) {
+		const auto free = connection.input_.size() - connection.input_size_; 
+		const auto received = ::read(connection.fd_, connection.input_.data() + connection.input_size_, free); 
+		if (received > 0) {
+			connection.input_size_ += static_cast<std::size_t>(received); 
+			Process(connection); 
+			continue; 
+		}
+		if (received < 0 && errno == EINTR) continue; 
+		if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			co_await Readable{ connection }; 
+			continue; 
+		}
+		break; 
+	}
+	Close(connection); 
+}
+
+void OrderGateway::Process(Connection& connection) {
+	const auto records = connection.input_size_ / sizeof(Command); 
+	for (std::size_t i = 0; i < records; ++i) {
+		Command command; 
+		std::memcpy(&command, connection.input_.data() + i * sizeof(Command), sizeof(Command)); 
+		//--- Malformed commands are answered before they take a sequence or reach the journal 
+		if (!books_.IsValidSymbol(command.symbol_id_) || !IsWellFormed(command)) {
+			command.sequence_ = 0; 
+			Acknowledge(connection, command, AckStatus::Rejected); 
+			continue; 
+		}
+		sequencer_.Stamp(command); 
+		if (journal_ && !journal_->Append(command)) {
+			Acknowledge(connection, command, AckStatus::Rejected); 
+			continue; 
+		}
+
+		AckStatus status; 
+		const auto trades = books_.Execute(command, status); 
+		const bool accepted = status == AckStatus::Accepted; 
+		//--- Only an accepted add owns its id, a rejected duplicate must not take over the resting order's route 
+		if (accepted && command.type_ == CommandType::Add) order_connections_[{ command.symbol_id_, command.order_id_ }] = connection.id_; 
+		Acknowledge(connection, command, status); 
+
+		//--- Fills report the remainder right after them. A resting order fills at most once per command, so it 
+		//--- has what still rests. The incoming order can fill many times, its later fills are counted back in 
+		const auto* book = books_.FindOrderBook(command.symbol_id_); 
+		auto Resting = [book](OrderId order_id) -> Quantity { 
+			const auto* order = book ? book->FindOrder(order_id) : nullptr; 
+			return order ? order->GetRemainingQuantity() : 0; 
 		};
+		Quantity incoming = Resting(command.order_id_); 
+		for (const auto& trade : trades) incoming += trade.GetBidTrade().quanity_; 
+		for (const auto& trade : trades) {
+			for (const auto side : { Side::Buy, Side::Sell }) {
+				const auto& fill = side == Side::Buy ? trade.GetBidTrade() : trade.GetAskTrade(); 
+				if (fill.order_id_ == command.order_id_) incoming -= fill.quanity_; 
+				const auto remaining = fill.order_id_ == command.order_id_ ? incoming : Resting(fill.order_id_); 
+				ReportFill(fill, side, command.symbol_id_, trade.GetSequence(), remaining); 
+			}
+		}
+
+		//--- Orders that left the book no longer need a route back to their connection 
+		if (!book || !book->Contains(command.order_id_)) order_connections_.erase({ command.symbol_id_, command.order_id_ }); 
+		for (const auto& trade : trades) {
+			for (auto order_id : { trade.GetBidTrade().order_id_, trade.GetAskTrade().order_id_ }) {
+				if (!book || !book->Contains(order_id)) order_connections_.erase({ command.symbol_id_, order_id }); 
+			}
+		}
+	}
 
-	for (const auto& [price, orders] : bids_) bid_infos.push_back(CreateLevelInfos(price, orders));
-	for (const auto& [price, orders] : asks_) ask_infos.push_back(CreateLevelInfos(price, orders));
+	//--- Keep a trailing partial record for the next read 
+	const auto consumed = records * sizeof(Command); 
+	std::memmove(connection.input_.data(), connection.input_.data() + consumed, connection.input_size_ - consumed); 
+	connection.input_size_ -= consumed; 
+}
 
-	return OrderBookLevelInfos{ bid_infos, ask_infos };
+void OrderGateway::Report(Connection& connection, std::span<const char> message) {
+	connection.output_.insert(connection.output_.end(), message.begin(), message.end()); 
+	if (!connection.dirty_) {
+		connection.dirty_ = true; 
+		dirty_.push_back(&connection); 
+	}
+}
+
+void OrderGateway::Acknowledge(Connection& connection, const Command& command, AckStatus status) {
+	char buffer[WireSchema::HeaderSize + WireSchema::OrderAckSize]; 
+	Report(connection, { buffer, EncodeOrderAck(buffer, command, status) }); 
+}
+
+void OrderGateway::ReportFill(const TradeInfo& fill, Side side, SymbolId symbol_id, SequenceNumber sequence, Quantity remaining) {
+	auto route = order_connections_.find({ symbol_id, fill.order_id_ }); 
+	if (route == order_connections_.end()) return; 
+	auto connection = connections_.find(route->second); 
+	if (connection == connections_.end() || connection->second->fd_ < 0) return; 
+
+	const OrderEvent event{ sequence, fill.order_id_, symbol_id, fill.price_, fill.quanity_, remaining, 0, OrderEventType::Executed, side }; 
+	char buffer[WireSchema::HeaderSize + WireSchema::OrderEventSize]; 
+	Report(*connection->second, { buffer, EncodeOrderEvent(buffer, event) }); 
+}
+
+void OrderGateway::Flush(Connection& connection) {
+	connection.dirty_ = false; 
+	while (connection.fd_ >= 0 && connection.output_offset_ < connection.output_.size()) {
+		const auto written = ::write(connection.fd_, connection.output_.data() + connection.output_offset_, 
+			connection.output_.size() - connection.output_offset_); 
+		if (written > 0) {
+			connection.output_offset_ += static_cast<std::size_t>(written); 
+			continue; 
+		}
+		if (written < 0 && errno == EINTR) continue; 
+		//--- Would block: the rest goes out on the next EPOLLOUT 
+		if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return; 
+		break; 
+	}
+	connection.output_.clear(); 
+	connection.output_offset_ = 0; 
+}
+
+void OrderGateway::Close(Connection& connection) {
+	if (connection.fd_ >= 0) ::close(connection.fd_); 
+	connection.fd_ = -1; 
+	closed_.push_back(connection.id_); 
+}
+#endif
+
+//--- Self checks for the snapshot, replay, parser and level delta paths, run with "check". Each one returns 
+//--- false on the first mismatch against a slower reference 
+std::vector<Command> RandomCommands(std::size_t count, std::size_t symbols, std::uint32_t seed) {
+	std::mt19937 random{ seed }; 
+	auto Draw = [&random](std::uint32_t bound) { return static_cast<std::uint32_t>(random() % bound); }; 
+	std::vector<Command> commands; 
+	commands.reserve(count); 
+	Sequencer sequencer; 
+	for (std::size_t i = 0; i < count; ++i) {
+		Command command{}; 
+		command.symbol_id_ = static_cast<SymbolId>(Draw(static_cast<std::uint32_t>(symbols))); 
+		command.owner_id_ = 1 + Draw(5); 
+		command.side_ = Draw(2) ? Side::Buy : Side::Sell; 
+		command.price_ = static_cast<Price>(90 + Draw(21)); 
+		command.quantity_ = 1 + Draw(20); 
+		command.order_type_ = Draw(10) ? OrderType::GoodTillCancel : OrderType::FillAndKill; 
+		const auto kind = Draw(10); 
+		if (kind < 6 || i == 0) {
+			command.type_ = CommandType::Add; 
+			command.order_id_ = i + 1; 
+		}
+		else {
+			command.type_ = kind < 8 ? CommandType::Cancel : CommandType::Modify; 
+			command.order_id_ = 1 + Draw(static_cast<std::uint32_t>(i)); 
+		}
+		sequencer.Stamp(command); 
+		commands.push_back(command); 
+	}
+	return commands; 
+}
+
+bool SameLevels(const LevelInfos& left, const LevelInfos& right) {
+	return std::equal(left.begin(), left.end(), right.begin(), right.end(), 
+		[](const LevelInfo& a, const LevelInfo& b) { return a.price_ == b.price_ && a.quantity_ == b.quantity_; }); 
+}
+
+bool SameBooks(const OrderBookManager& left, const OrderBookManager& right) {
+	for (SymbolId symbol_id = 0; symbol_id < std::max(left.Capacity(), right.Capacity()); ++symbol_id) {
+		const auto* a = left.FindOrderBook(symbol_id); 
+		const auto* b = right.FindOrderBook(symbol_id); 
+		if (!a || !b) {
+			if ((a && a->Size()) || (b && b->Size())) return false; 
+			continue; 
+		}
+		if (a->Size() != b->Size() || a->GetEventSequence() != b->GetEventSequence()) return false; 
+		const auto ours = a->GetOrderInfos(); 
+		const auto theirs = b->GetOrderInfos(); 
+		if (!SameLevels(ours.GeBids(), theirs.GeBids()) || !SameLevels(ours.GetAsks(), theirs.GetAsks())) return false; 
+	}
+	return true; 
+}
+
+//--- A manager restored halfway through a command stream must trade exactly like the one it was taken from, 
+//--- and a truncated or corrupted snapshot must throw without touching the books it was restored into 
+bool CheckSnapshotRoundTrip() {
+	constexpr std::size_t Symbols = 4; 
+	const auto commands = RandomCommands(40000, Symbols, 7); 
+	const auto half = commands.size() / 2; 
+
+	OrderBookManager live{ 0, SelfTradePrevention::CancelNewest }; 
+	for (std::size_t i = 0; i < half; ++i) live.Execute(commands[i]); 
+	std::vector<char> snapshot; 
+	live.Serialize(snapshot); 
+
+	OrderBookManager restored; 
+	restored.Restore(snapshot); 
+	if (restored.GetAppliedCommands() != live.GetAppliedCommands() || !SameBooks(live, restored)) return false; 
+	for (std::size_t i = half; i < commands.size(); ++i) {
+		const auto expected = live.Execute(commands[i]); 
+		const auto actual = restored.Execute(commands[i]); 
+		const auto same = std::equal(expected.begin(), expected.end(), actual.begin(), actual.end(), [](const Trade& a, const Trade& b) {
+			return a.GetSequence() == b.GetSequence() 
+				&& a.GetBidTrade().order_id_ == b.GetBidTrade().order_id_ && a.GetAskTrade().order_id_ == b.GetAskTrade().order_id_ 
+				&& a.GetBidTrade().price_ == b.GetBidTrade().price_ && a.GetBidTrade().quanity_ == b.GetBidTrade().quanity_; 
+		}); 
+		if (!same) return false; 
+	}
+	if (!SameBooks(live, restored)) return false; 
+
+	std::vector<char> current; 
+	restored.Serialize(current); 
+	auto Rejected = [&restored, &current](std::span<const char> bytes) {
+		try {
+			restored.Restore(bytes); 
+		}
+		catch (const std::exception&) {
+			std::vector<char> after; 
+			restored.Serialize(after); 
+			return after == current; 
+		}
+		return false; 
+	};
+	auto corrupted = snapshot; 
+	corrupted[0] ^= 0x5A; 
+	return Rejected(std::span<const char>{ snapshot }.first(snapshot.size() / 2)) 
+		&& Rejected(std::span<const char>{ snapshot }.first(snapshot.size() - 1)) 
+		&& Rejected(corrupted); 
+}
+
+//--- Replays a generated ITCH stream, fed in two pieces split mid-message, and compares every level of every 
+//--- book with a plain model of the resting orders. Prices never cross, as in the real feed 
+bool CheckItchReplay() {
+	struct Resting {
+		std::uint16_t locate_; 
+		char side_; 
+		std::uint32_t shares_; 
+		std::uint32_t price_; 
+	};
+	std::mt19937 random{ 5 }; 
+	auto Draw = [&random](std::uint32_t low, std::uint32_t high) { return low + static_cast<std::uint32_t>(random() % (high - low + 1)); }; 
+	std::vector<char> stream; 
+	std::vector<char> message; 
+	auto Put = [&message](std::uint64_t value, std::size_t bytes) {
+		for (std::size_t i = bytes; i-- > 0;) message.push_back(static_cast<char>(value >> (8 * i))); 
+	};
+	auto Begin = [&message, &Put](char type, std::uint16_t locate) {
+		message.assign(1, type); 
+		Put(locate, 2); 
+		Put(0, 8); 
+	};
+	auto End = [&stream, &message] {
+		stream.push_back(static_cast<char>(message.size() >> 8)); 
+		stream.push_back(static_cast<char>(message.size())); 
+		stream.insert(stream.end(), message.begin(), message.end()); 
+	};
+	auto DrawPrice = [&Draw](char side) { return side == 'B' ? Draw(900000, 999900) : Draw(1000100, 1100000); }; 
+
+	std::map<OrderId, Resting> resting; 
+	std::vector<OrderId> references; 
+	OrderId next = 1; 
+	auto Add = [&](OrderId reference, const Resting& order) {
+		resting[reference] = order; 
+		references.push_back(reference); 
+	};
+	auto Remove = [&](std::size_t index) {
+		resting.erase(references[index]); 
+		references[index] = references.back(); 
+		references.pop_back(); 
+	};
+	Begin('S', 0); 
+	Put('O', 1); 
+	End(); 
+	for (int i = 0; i < 50000; ++i) {
+		if (references.empty() || Draw(0, 99) < 45) {
+			const Resting order{ static_cast<std::uint16_t>(Draw(1, 20)), Draw(0, 1) ? 'B' : 'S', Draw(1, 500), 0 }; 
+			const auto price = DrawPrice(order.side_); 
+			const bool attributed = Draw(0, 4) == 0; 
+			Begin(attributed ? 'F' : 'A', order.locate_); 
+			Put(next, 8); 
+			Put(static_cast<unsigned char>(order.side_), 1); 
+			Put(order.shares_, 4); 
+			Put(0x4142434420202020ull, 8); 
+			Put(price, 4); 
+			if (attributed) Put(0x4D504944, 4); 
+			End(); 
+			Add(next++, Resting{ order.locate_, order.side_, order.shares_, price }); 
+			continue; 
+		}
+		const auto index = Draw(0, static_cast<std::uint32_t>(references.size() - 1)); 
+		const auto reference = references[index]; 
+		auto& order = resting[reference]; 
+		const auto kind = Draw(0, 99); 
+		if (kind < 20) {
+			Begin('D', order.locate_); 
+			Put(reference, 8); 
+			End(); 
+			Remove(index); 
+		}
+		else if (kind < 40) {
+			const Resting replacement{ order.locate_, order.side_, Draw(1, 500), DrawPrice(order.side_) }; 
+			Begin('U', order.locate_); 
+			Put(reference, 8); 
+			Put(next, 8); 
+			Put(replacement.shares_, 4); 
+			Put(replacement.price_, 4); 
+			End(); 
+			Remove(index); 
+			Add(next++, replacement); 
+		}
+		else {
+			const auto shares = Draw(1, order.shares_); 
+			const char type = kind < 65 ? 'E' : kind < 75 ? 'C' : 'X'; 
+			Begin(type, order.locate_); 
+			Put(reference, 8); 
+			Put(shares, 4); 
+			if (type != 'X') Put(7, 8); 
+			if (type == 'C') {
+				Put('Y', 1); 
+				Put(order.price_, 4); 
+			}
+			End(); 
+			order.shares_ -= shares; 
+			if (order.shares_ == 0) Remove(index); 
+		}
+	}
+
+	OrderBookManager books; 
+	ItchReplay replay{ books }; 
+	const auto split = stream.size() / 2 + 1; 
+	const auto consumed = replay.Replay(std::span<const char>{ stream }.first(split)); 
+	if (consumed > split || replay.Replay(std::span<const char>{ stream }.subspan(consumed)) != stream.size() - consumed) return false; 
+	if (replay.GetStats().ignored_ != 1) return false; 
+
+	struct Levels {
+		std::map<std::uint32_t, Quantity, std::greater<>> bids_; 
+		std::map<std::uint32_t, Quantity> asks_; 
+	};
+	std::map<SymbolId, Levels> levels; 
+	for (const auto& [reference, order] : resting) {
+		auto& book = levels[order.locate_]; 
+		if (order.side_ == 'B') book.bids_[order.price_] += order.shares_; 
+		else book.asks_[order.price_] += order.shares_; 
+	}
+	auto SameSide = [](const LevelInfos& actual, const auto& expected) {
+		return std::equal(actual.begin(), actual.end(), expected.begin(), expected.end(), 
+			[](const LevelInfo& level, const auto& entry) { return static_cast<std::uint32_t>(level.price_) == entry.first && level.quantity_ == entry.second; }); 
+	};
+	std::size_t orders = 0; 
+	for (SymbolId symbol_id = 0; symbol_id < books.Capacity(); ++symbol_id) {
+		const auto* book = books.FindOrderBook(symbol_id); 
+		if (!book) continue; 
+		orders += book->Size(); 
+		const auto infos = book->GetOrderInfos(); 
+		const auto& expected = levels[symbol_id]; 
+		if (!SameSide(infos.GeBids(), expected.bids_) || !SameSide(infos.GetAsks(), expected.asks_)) return false; 
+	}
+	return orders == resting.size(); 
+}
+
+//--- Writes a few megabytes of order flow with headers, comments and CRLF lines, then checks that the serial 
+//--- and chunked parses both give back the generated commands and that batched Apply trades like Execute 
+bool CheckOrderFlowParse() {
+	const auto generated = RandomCommands(120000, 1, 9); 
+	std::string text = "timestamp,type,id,side,price,quantity\n"; 
+	for (std::size_t i = 0; i < generated.size(); ++i) {
+		const auto& command = generated[i]; 
+		if (i % 5000 == 0) text += "# checkpoint\n"; 
+		const char type = command.type_ == CommandType::Add ? 'A' : command.type_ == CommandType::Cancel ? 'C' : 'M'; 
+		text += std::format("{},{},{}", 1000000 + i, type, command.order_id_); 
+		if (command.type_ != CommandType::Cancel) 
+			text += std::format(",{},{},{}", command.side_ == Side::Buy ? 'B' : 'S', command.price_, command.quantity_); 
+		text += i % 7 ? "\n" : "\r\n"; 
+	}
+
+	auto SameCommand = [](const Command& a, const Command& b) {
+		if (a.sequence_ != b.sequence_ || a.type_ != b.type_ || a.order_id_ != b.order_id_ || a.symbol_id_ != b.symbol_id_) return false; 
+		return a.type_ == CommandType::Cancel 
+			|| (a.side_ == b.side_ && a.price_ == b.price_ && a.quantity_ == b.quantity_ && a.order_type_ == b.order_type_); 
+	};
+	auto expected = generated; 
+	for (auto& command : expected) command.order_type_ = OrderType::GoodTillCancel; 
+	const std::span<const char> bytes{ text.data(), text.size() }; 
+	const auto serial = ParseOrderFlow(bytes, 0, 1); 
+	const auto chunked = ParseOrderFlow(bytes, 0, 4); 
+	if (!std::equal(serial.begin(), serial.end(), expected.begin(), expected.end(), SameCommand) 
+		|| !std::equal(chunked.begin(), chunked.end(), expected.begin(), expected.end(), SameCommand)) 
+		return false; 
+
+	OrderBook batched; 
+	OrderBookManager single; 
+	Trades expected_trades; 
+	Trades actual_trades; 
+	const std::span<const Command> all{ chunked }; 
+	for (std::size_t offset = 0; offset < all.size(); offset += 1024) {
+		const auto batch = all.subspan(offset, std::min<std::size_t>(1024, all.size() - offset)); 
+		const auto trades = batched.Apply(batch); 
+		actual_trades.insert(actual_trades.end(), trades.begin(), trades.end()); 
+		for (const auto& command : batch) {
+			const auto one = single.Execute(command); 
+			expected_trades.insert(expected_trades.end(), one.begin(), one.end()); 
+		}
+	}
+	const auto same_trades = std::equal(actual_trades.begin(), actual_trades.end(), expected_trades.begin(), expected_trades.end(), 
+		[](const Trade& a, const Trade& b) {
+			return a.GetBidTrade().order_id_ == b.GetBidTrade().order_id_ && a.GetAskTrade().order_id_ == b.GetAskTrade().order_id_ 
+				&& a.GetBidTrade().price_ == b.GetBidTrade().price_ && a.GetBidTrade().quanity_ == b.GetBidTrade().quanity_; 
+		}); 
+	const auto infos = batched.GetOrderInfos(); 
+	const auto single_infos = single.GetOrderBook(0).GetOrderInfos(); 
+	return same_trades && batched.Size() == single.GetOrderBook(0).Size() 
+		&& SameLevels(infos.GeBids(), single_infos.GeBids()) && SameLevels(infos.GetAsks(), single_infos.GetAsks()); 
+}
+
+//--- Runs every book mutator under each self-trade mode and rebuilds the levels from the deltas alone. After 
+//--- each call the rebuilt levels must equal GetOrderInfos, and no batch may name a level twice, add one that 
+//--- exists or change one to the values it already had 
+bool CheckLevelDeltas() {
+	for (const auto self_trade_prevention : { SelfTradePrevention::None, SelfTradePrevention::CancelNewest, 
+		SelfTradePrevention::CancelBoth, SelfTradePrevention::Decrement }) {
+		OrderBook book{ self_trade_prevention }; 
+		std::map<std::pair<Side, Price>, std::pair<Quantity, std::uint32_t>> levels; 
+		bool consistent = true; 
+		book.SetLevelHandler([&levels, &consistent](std::span<const LevelDelta> deltas) {
+			for (std::size_t i = 0; i < deltas.size(); ++i) {
+				const auto& delta = deltas[i]; 
+				const std::pair key{ delta.side_, delta.price_ }; 
+				for (std::size_t j = 0; j < i; ++j) consistent &= deltas[j].side_ != delta.side_ || deltas[j].price_ != delta.price_; 
+				const auto level = levels.find(key); 
+				const std::pair value{ delta.quantity_, delta.orders_ }; 
+				switch (delta.action_) {
+				case LevelAction::New: 
+					consistent &= level == levels.end(); 
+					levels[key] = value; 
+					break; 
+				case LevelAction::Change: 
+					consistent &= level != levels.end() && level->second != value; 
+					levels[key] = value; 
+					break; 
+				case LevelAction::Delete: 
+					consistent &= level != levels.end(); 
+					if (level != levels.end()) levels.erase(level); 
+					break; 
+				}
+			}
+		}); 
+
+		std::mt19937 random{ 11 }; 
+		auto Draw = [&random](std::uint32_t bound) { return static_cast<std::uint32_t>(random() % bound); }; 
+		OrderId next = 1; 
+		for (int i = 0; i < 20000 && consistent; ++i) {
+			const auto side = Draw(2) ? Side::Buy : Side::Sell; 
+			const auto price = static_cast<Price>(95 + Draw(11)); 
+			const Quantity quantity = 1 + Draw(20); 
+			const OwnerId owner_id = 1 + Draw(4); 
+			const auto existing = static_cast<OrderId>(1 + Draw(static_cast<std::uint32_t>(next))); 
+			const auto kind = Draw(100); 
+			if (kind < 45) 
+				book.AddOrder(std::make_shared<Order>(Draw(8) ? OrderType::GoodTillCancel : OrderType::FillAndKill, next++, side, price, quantity, owner_id)); 
+			else if (kind < 60) book.CancelOrder(existing); 
+			else if (kind < 70) book.MatchOrder(OrderModify(existing, side, price, quantity)); 
+			else if (kind < 75) book.ReduceOrder(existing, 1 + Draw(5)); 
+			else if (kind < 77) book.MassCancel(owner_id); 
+			else if (kind < 78) book.MassCancel(side, price - 2, price + 2); 
+			else if (kind < 80) {
+				Quotes quotes; 
+				for (int k = 0; k < 3; ++k) 
+					quotes.push_back(Quote{ next++, k % 2 ? Side::Buy : Side::Sell, static_cast<Price>(95 + Draw(11)), 1 + Draw(9) }); 
+				book.MassQuote(owner_id, quotes); 
+			}
+			else if (kind < 90) {
+				std::vector<Command> commands(8); 
+				for (auto& command : commands) {
+					command.order_type_ = OrderType::GoodTillCancel; 
+					command.owner_id_ = 1 + Draw(4); 
+					command.type_ = static_cast<CommandType>(Draw(3)); 
+					command.order_id_ = command.type_ == CommandType::Add ? next++ : 1 + Draw(static_cast<std::uint32_t>(next)); 
+					command.side_ = Draw(2) ? Side::Buy : Side::Sell; 
+					command.price_ = static_cast<Price>(95 + Draw(11)); 
+					command.quantity_ = 1 + Draw(20); 
+				}
+				book.Apply(commands); 
+			}
+			else if (kind < 91) {
+				book.BeginAuction(); 
+				for (int k = 0; k < 5; ++k) 
+					book.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, next++, k % 2 ? Side::Buy : Side::Sell, static_cast<Price>(95 + Draw(11)), 1 + Draw(20), owner_id)); 
+				book.Uncross(); 
+			}
+			else book.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, next++, side, price, quantity, owner_id)); 
+
+			const auto infos = book.GetOrderInfos(); 
+			std::size_t compared = 0; 
+			for (const auto& [side_levels, level_side] : { std::pair{ &infos.GeBids(), Side::Buy }, std::pair{ &infos.GetAsks(), Side::Sell } }) {
+				for (const auto& level : *side_levels) {
+					const auto rebuilt = levels.find({ level_side, level.price_ }); 
+					consistent &= rebuilt != levels.end() && rebuilt->second.first == level.quantity_; 
+				}
+				compared += side_levels->size(); 
+			}
+			consistent &= compared == levels.size(); 
+		}
+		if (!consistent) return false; 
+	}
+	return true; 
 }
 
+int main(int argc, char* argv[]) {
+	if (argc == 3 && std::string_view{ argv[1] } == "itch") {
+		OrderBookManager books; 
+		const auto stats = ReplayItchFile(argv[2], books); 
+		std::size_t resting = 0; 
+		for (SymbolId symbol_id = 0; symbol_id < books.Capacity(); ++symbol_id) {
+			if (auto* book = books.FindOrderBook(symbol_id)) resting += book->Size(); 
+		}
+		const auto seconds = stats.elapsed_.count() / 1e9; 
+		std::cout << std::format("{} messages ({} add, {} execute, {} cancel, {} delete, {} replace, {} ignored)\n", 
+			stats.messages_, stats.adds_, stats.executions_, stats.cancels_, stats.deletes_, stats.replaces_, stats.ignored_); 
+		std::cout << std::format("{:.3f} s, {:.0f} msgs/sec, {:.0f} MB/s, {} books, {} resting orders\n", 
+			seconds, stats.MessagesPerSecond(), stats.bytes_ / 1e6 / seconds, books.ActiveBooks(), resting); 
+		return 0; 
+	}
+	if (argc == 2 && std::string_view{ argv[1] } == "check") {
+		const std::pair<const char*, bool (*)()> checks[] = {
+			{ "snapshot round trip", CheckSnapshotRoundTrip }, 
+			{ "itch replay", CheckItchReplay }, 
+			{ "order flow parse", CheckOrderFlowParse }, 
+			{ "level deltas", CheckLevelDeltas }, 
+		}; 
+		int failed = 0; 
+		for (const auto& [name, check] : checks) {
+			const auto passed = check(); 
+			std::cout << std::format("{} {}\n", passed ? "pass" : "FAIL", name); 
+			failed += !passed; 
+		}
+		return failed ? 1 : 0; 
+	}
+	if (argc == 3 && std::string_view{ argv[1] } == "flow") {
+		const auto start = std::chrono::steady_clock::now(); 
+		const auto commands = ReadOrderFlowFile(argv[2]); 
+		const auto parsed = std::chrono::steady_clock::now(); 
+
+		OrderBook book; 
+		std::size_t trades = 0; 
+		const std::span<const Command> all{ commands }; 
+		for (std::size_t offset = 0; offset < all.size(); offset += 1024) 
+			trades += book.Apply(all.subspan(offset, std::min<std::size_t>(1024, all.size() - offset))).size(); 
+		const auto applied = std::chrono::steady_clock::now(); 
+
+		using Milliseconds = std::chrono::duration<double, std::milli>; 
+		std::cout << std::format("{} commands parsed in {:.1f} ms, applied in {:.1f} ms, {} trades, {} resting orders\n", 
+			commands.size(), Milliseconds{ parsed - start }.count(), Milliseconds{ applied - parsed }.count(), trades, book.Size()); 
+		return 0; 
+	}
 
-int main() {
 	OrderBook orderbook;
 	const OrderId order_id = 1;
 	orderbook.AddOrder(std::make_shared<Order>(OrderType::GoodTillCancel, order_id, Side::Sell, 100, 10));
@@ -325,4 +4449,4 @@ int main() {
 	//orderbook.CancelOrder(order_id);
 	//std::cout << orderbook.Size() << std::endl; 
 	return 0;
-}
\ No newline at end of file
+}